@@ -0,0 +1,354 @@
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/random.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/string.h>
+#include <linux/timex.h>
+#include <linux/uaccess.h>
+#include "bench.h"
+#include "bn.h"
+#include "ntt.h"
+
+// most operand sizes in a sweep
+#define FIB_BENCH_SIZES 16
+// the tables of the transforms stay cached until the module is unloaded,
+// those of ntt and intt on operands of this many limbs take 2^19 points and
+// about 10MB, so that a benchmark pins no more than a large request does
+#define FIB_BENCH_MAX_LIMBS (1UL << 15)
+// the schoolbook product of larger operands takes seconds per run
+#define FIB_BENCH_MUL_LIMBS (1UL << 14)
+// bn_strassen hands larger operands over to bn_fast_mul
+#define FIB_BENCH_STRASSEN_LIMBS (1UL << 11)
+#define FIB_BENCH_MAX_REPS 1000
+
+/**
+ * fib_bench_ops - operands of the primitives for one size
+ * @a: first operand, larger than b
+ * @b: second operand
+ * @t: copy of a taken before every run of a primitive that modifies it
+ * @c: result of the products
+ * @x: coefficients of a transform of the length bn_strassen uses
+ * @tbl: table of that transform
+ */
+struct fib_bench_ops {
+    bn *a, *b, *t, *c;
+    uint64_t *x;
+    const struct ntt_table *tbl;
+};
+
+static int fib_bench_add(struct fib_bench_ops *o)
+{
+    return bn_add(o->t, o->b);
+}
+
+static int fib_bench_sub(struct fib_bench_ops *o)
+{
+    bn_sub(o->t, o->b);
+    return 0;
+}
+
+static int fib_bench_lshift(struct fib_bench_ops *o)
+{
+    return bn_lshift(o->t, 1);
+}
+
+static int fib_bench_mul(struct fib_bench_ops *o)
+{
+    return bn_mul(o->a, o->b, o->c);
+}
+
+static int fib_bench_fast_mul(struct fib_bench_ops *o)
+{
+    return bn_fast_mul(o->a, o->b, o->c, NULL);
+}
+
+static int fib_bench_strassen(struct fib_bench_ops *o)
+{
+    return bn_strassen(o->a, o->b, o->c);
+}
+
+static int fib_bench_sqr_strassen(struct fib_bench_ops *o)
+{
+    return bn_sqr_strassen(o->a, o->c);
+}
+
+static int fib_bench_ntt(struct fib_bench_ops *o)
+{
+    ntt(o->x, o->tbl);
+    return 0;
+}
+
+static int fib_bench_intt(struct fib_bench_ops *o)
+{
+    intt(o->x, o->tbl);
+    return 0;
+}
+
+/**
+ * fib_bench_prim - a timed primitive
+ * @name: name in the results
+ * @fn: runs the primitive once, returns 0 on success, -ENOMEM if it failed
+ * @copy: the primitive modifies t, which is reset to a before every run
+ * @max: most limbs of the operands, larger sizes are skipped
+ */
+static const struct fib_bench_prim {
+    const char *name;
+    int (*fn)(struct fib_bench_ops *o);
+    bool copy;
+    size_t max;
+} fib_bench_prims[] = {
+    {"bn_add", fib_bench_add, true, FIB_BENCH_MAX_LIMBS},
+    {"bn_sub", fib_bench_sub, true, FIB_BENCH_MAX_LIMBS},
+    {"bn_lshift", fib_bench_lshift, true, FIB_BENCH_MAX_LIMBS},
+    {"bn_mul", fib_bench_mul, false, FIB_BENCH_MUL_LIMBS},
+    {"bn_fast_mul", fib_bench_fast_mul, false, FIB_BENCH_MAX_LIMBS},
+    {"bn_strassen", fib_bench_strassen, false, FIB_BENCH_STRASSEN_LIMBS},
+    {"bn_sqr_strassen", fib_bench_sqr_strassen, false,
+     FIB_BENCH_STRASSEN_LIMBS},
+    {"ntt", fib_bench_ntt, false, FIB_BENCH_MAX_LIMBS},
+    {"intt", fib_bench_intt, false, FIB_BENCH_MAX_LIMBS},
+};
+
+// a header and a line per primitive and size
+#define FIB_BENCH_OUT \
+    (64 * (FIB_BENCH_SIZES * ARRAY_SIZE(fib_bench_prims) + 1))
+
+// serializes the runs and guards the settings and the results below
+static DEFINE_MUTEX(fib_bench_lock);
+static unsigned long fib_bench_sizes[FIB_BENCH_SIZES] = {16, 128, 1024, 8192};
+static int fib_bench_nr = 4;
+static u32 fib_bench_warmup = 2;
+static u32 fib_bench_reps = 9;
+static char fib_bench_out[FIB_BENCH_OUT];
+static size_t fib_bench_len;
+
+static int fib_bench_cmp(const void *a, const void *b)
+{
+    u64 x = *(const u64 *) a, y = *(const u64 *) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * fib_bench_prepare: fill the operands with random numbers of n limbs
+ * @o: operands, allocated by the caller
+ * @n: number of limbs
+ * @return: 0 on success, -ENOMEM if failed to allocate memory
+ */
+static int fib_bench_prepare(struct fib_bench_ops *o, size_t n)
+{
+    int len = nextpow2(2 * n * sizeof(uint64_t));
+    if (bn_resize(o->a, n) || bn_resize(o->b, n) || bn_reserve(o->t, n + 1) ||
+        bn_reserve(o->c, 2 * n))
+        return -ENOMEM;
+    get_random_bytes(o->a->digits, n * sizeof(uint64_t));
+    get_random_bytes(o->b->digits, n * sizeof(uint64_t));
+    o->a->digits[n - 1] |= 1ULL << 63;
+    o->b->digits[n - 1] = o->b->digits[n - 1] >> 1 | 1;
+
+    kvfree(o->x);
+    o->x = kvmalloc_array(len, sizeof(uint64_t), GFP_KERNEL);
+    o->tbl = ntt_table_get(len, 0);
+    if (!o->x || !o->tbl)
+        return -ENOMEM;
+    // bytes, as bn_split makes them
+    get_random_bytes(o->x, len * sizeof(uint64_t));
+    for (int i = 0; i < len; i++)
+        o->x[i] &= 0xff;
+    return 0;
+}
+
+/**
+ * fib_bench_time: run a primitive warmup + reps times
+ * @p: the primitive
+ * @o: its operands
+ * @warmup: number of untimed runs
+ * @reps: number of timed runs
+ * @cycles: stores the cycles of the timed runs
+ * @return: 0 on success, -ENOMEM if the primitive or the copy failed to
+ * allocate memory, -EINTR if the task was killed
+ */
+static int fib_bench_time(const struct fib_bench_prim *p,
+                          struct fib_bench_ops *o,
+                          u32 warmup,
+                          u32 reps,
+                          u64 *cycles)
+{
+    for (u32 r = 0; r < warmup + reps; r++) {
+        if (p->copy && bn_copy(o->t, o->a))
+            return -ENOMEM;
+        cycles_t start = get_cycles();
+        int rc = p->fn(o);
+        cycles_t end = get_cycles();
+        if (rc)
+            return rc;
+        if (r >= warmup)
+            cycles[r - warmup] = end - start;
+        if (fatal_signal_pending(current))
+            return -EINTR;
+        cond_resched();
+    }
+    return 0;
+}
+
+/*
+ * Time every primitive for every size and keep a line per pair with the
+ * median and the minimum number of cycles, or - for sizes beyond the range
+ * of the primitive, fib_bench_lock is held
+ */
+static int fib_bench_run(void)
+{
+    u32 warmup = READ_ONCE(fib_bench_warmup);
+    u32 reps = clamp_t(u32, READ_ONCE(fib_bench_reps), 1, FIB_BENCH_MAX_REPS);
+    struct fib_bench_ops o = {
+        .a = bn_alloc(1),
+        .b = bn_alloc(1),
+        .t = bn_alloc(1),
+        .c = bn_alloc(1),
+    };
+    u64 *cycles = kmalloc_array(reps, sizeof(u64), GFP_KERNEL);
+    size_t len = scnprintf(fib_bench_out, FIB_BENCH_OUT,
+                           "%-16s %8s %12s %12s\n", "primitive", "limbs",
+                           "median", "min");
+    int rc = -ENOMEM;
+    if (!o.a || !o.b || !o.t || !o.c || !cycles)
+        goto out;
+    for (int i = 0; i < fib_bench_nr; i++) {
+        size_t n = fib_bench_sizes[i];
+        rc = fib_bench_prepare(&o, n);
+        if (rc)
+            goto out;
+        for (int j = 0; j < ARRAY_SIZE(fib_bench_prims); j++) {
+            const struct fib_bench_prim *p = &fib_bench_prims[j];
+            if (n > p->max) {
+                len += scnprintf(fib_bench_out + len, FIB_BENCH_OUT - len,
+                                 "%-16s %8zu %12s %12s\n", p->name, n, "-",
+                                 "-");
+                continue;
+            }
+            rc = fib_bench_time(p, &o, warmup, reps, cycles);
+            if (rc)
+                goto out;
+            sort(cycles, reps, sizeof(u64), fib_bench_cmp, NULL);
+            len += scnprintf(fib_bench_out + len, FIB_BENCH_OUT - len,
+                             "%-16s %8zu %12llu %12llu\n", p->name, n,
+                             cycles[reps / 2], cycles[0]);
+        }
+    }
+out:
+    // the results of a failed run are dropped
+    fib_bench_len = rc ? 0 : len;
+    kfree(cycles);
+    kvfree(o.x);
+    bn_free(o.a);
+    bn_free(o.b);
+    bn_free(o.t);
+    bn_free(o.c);
+    return rc;
+}
+
+static ssize_t fib_bench_read(struct file *file,
+                              char __user *buf,
+                              size_t count,
+                              loff_t *ppos)
+{
+    ssize_t ret;
+    if (mutex_lock_killable(&fib_bench_lock))
+        return -EINTR;
+    ret = simple_read_from_buffer(buf, count, ppos, fib_bench_out,
+                                  fib_bench_len);
+    mutex_unlock(&fib_bench_lock);
+    return ret;
+}
+
+// writing anything runs the benchmark, it returns once the results are ready
+static ssize_t fib_bench_write(struct file *file,
+                               const char __user *buf,
+                               size_t count,
+                               loff_t *ppos)
+{
+    int rc;
+    if (mutex_lock_killable(&fib_bench_lock))
+        return -EINTR;
+    rc = fib_bench_run();
+    mutex_unlock(&fib_bench_lock);
+    return rc ? rc : count;
+}
+
+static const struct file_operations fib_bench_fops = {
+    .owner = THIS_MODULE,
+    .read = fib_bench_read,
+    .write = fib_bench_write,
+    .llseek = default_llseek,
+};
+
+static ssize_t fib_bench_sizes_read(struct file *file,
+                                    char __user *buf,
+                                    size_t count,
+                                    loff_t *ppos)
+{
+    char str[FIB_BENCH_SIZES * 21 + 1];
+    size_t len = 0;
+    if (mutex_lock_killable(&fib_bench_lock))
+        return -EINTR;
+    for (int i = 0; i < fib_bench_nr; i++)
+        len += scnprintf(str + len, sizeof(str) - len, "%lu%c",
+                         fib_bench_sizes[i],
+                         i == fib_bench_nr - 1 ? '\n' : ' ');
+    mutex_unlock(&fib_bench_lock);
+    return simple_read_from_buffer(buf, count, ppos, str, len);
+}
+
+// the sizes are numbers of limbs separated by white space
+static ssize_t fib_bench_sizes_write(struct file *file,
+                                     const char __user *buf,
+                                     size_t count,
+                                     loff_t *ppos)
+{
+    unsigned long sizes[FIB_BENCH_SIZES];
+    int nr = 0;
+    ssize_t ret = count;
+    char *str = memdup_user_nul(buf, count), *p = str, *tok;
+    if (IS_ERR(str))
+        return PTR_ERR(str);
+    while ((tok = strsep(&p, " \t\n"))) {
+        if (!*tok)
+            continue;
+        if (nr == FIB_BENCH_SIZES || kstrtoul(tok, 0, &sizes[nr]) ||
+            !sizes[nr] || sizes[nr] > FIB_BENCH_MAX_LIMBS) {
+            ret = -EINVAL;
+            break;
+        }
+        nr++;
+    }
+    kfree(str);
+    if (!nr)
+        ret = -EINVAL;
+    if (ret < 0)
+        return ret;
+    if (mutex_lock_killable(&fib_bench_lock))
+        return -EINTR;
+    memcpy(fib_bench_sizes, sizes, nr * sizeof(*sizes));
+    fib_bench_nr = nr;
+    mutex_unlock(&fib_bench_lock);
+    return ret;
+}
+
+static const struct file_operations fib_bench_sizes_fops = {
+    .owner = THIS_MODULE,
+    .read = fib_bench_sizes_read,
+    .write = fib_bench_sizes_write,
+    .llseek = default_llseek,
+};
+
+void fib_bench_init(struct dentry *dir)
+{
+    debugfs_create_file("bench", 0600, dir, NULL, &fib_bench_fops);
+    debugfs_create_file("sizes", 0600, dir, NULL, &fib_bench_sizes_fops);
+    debugfs_create_u32("warmup", 0600, dir, &fib_bench_warmup);
+    debugfs_create_u32("reps", 0600, dir, &fib_bench_reps);
+}
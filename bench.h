@@ -0,0 +1,14 @@
+#ifndef __FIB_BENCH_H_
+#define __FIB_BENCH_H_
+
+#include <linux/debugfs.h>
+
+/**
+ * fib_bench_init: create the benchmark files in debugfs
+ * The module works without them, failures are not reported
+ * @dir: debugfs directory of the module, removing it waits for a running
+ * benchmark to finish
+ */
+void fib_bench_init(struct dentry *dir);
+
+#endif
@@ -1,3 +1,8 @@
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/vmalloc.h>
 #include "bn.h"
 #include "ntt.h"
 
@@ -6,55 +11,165 @@
 #define mask 0xffffffffffffffff
 #define val_size 64
 #define per_size (val_size / chunck_size)
+// a coefficient of a product by bn_strassen adds up to this many products of
+// two chunks, more would reach mod
+#define STRASSEN_MAX_CHUNKS ((mod - 1) / (chunk_mask * chunk_mask))
+// chunks of the multi-prime transform
+#define crt_chunk_size 32
+#define crt_chunk_mask 0xffffffff
+#define crt_per_size (val_size / crt_chunk_size)
+// inverse of 3 modulo 2^64
+#define INV3 0xaaaaaaaaaaaaaaab
 
-void bn_add(struct list_head *a, struct list_head *b)
+// operand sizes in limbs to switch to a faster multiplication
+#define KARATSUBA_THRESHOLD 32
+#define TOOM3_THRESHOLD 128
+#define SQR_KARATSUBA_THRESHOLD 48
+#define NTT_THRESHOLD 8192
+
+// fib(k) for k below LEAD_MAX_K keeps the exponents of bn_fib_lead in range
+#define LEAD_MAX_K (1ULL << 62)
+#define LEAD_MAX_LIMBS 12
+
+#ifdef BN_DEBUG
+atomic_long_t bn_alloc_count = ATOMIC_LONG_INIT(0);
+#endif
+
+struct kmem_cache *bn_cachep;
+
+int bn_init(void)
 {
-    __bn_add(a, b);
+    bn_cachep = kmem_cache_create("fibdrv_bn", sizeof(bn), 0, 0, NULL);
+    return bn_cachep ? 0 : -ENOMEM;
 }
 
-void bn_add_to_smaller(struct list_head *a, struct list_head *b)
+void bn_exit(void)
+{
+    kmem_cache_destroy(bn_cachep);
+}
+
+static bool stretch_measure;
+module_param(stretch_measure, bool, 0644);
+MODULE_PARM_DESC(stretch_measure,
+                 "Measure the stretches of the calculations between two "
+                 "preemption points");
+
+static unsigned long stretch_max_ns;
+module_param(stretch_max_ns, ulong, 0644);
+MODULE_PARM_DESC(stretch_max_ns,
+                 "Longest stretch measured in nanoseconds, write 0 to reset");
+
+static unsigned long stretch_budget_ns = 1000000;
+module_param(stretch_budget_ns, ulong, 0644);
+MODULE_PARM_DESC(stretch_budget_ns,
+                 "Measured stretches longer than this are logged, 0 to "
+                 "disable");
+
+DEFINE_PER_CPU(unsigned long, bn_work);
+
+/**
+ * bn_stretch - the stretch a cpu is running since its last preemption point
+ * @task: task running the stretch
+ * @nsw: context switches of the task when the stretch started, it ended
+ * early if the task slept anywhere in between, on a lock or in a wait
+ * @start: time the stretch started
+ */
+struct bn_stretch {
+    struct task_struct *task;
+    unsigned long nsw;
+    u64 start;
+};
+
+static DEFINE_PER_CPU(struct bn_stretch, bn_stretch);
+
+/**
+ * bn_stretch_end: record the stretch ending at a preemption point
+ * The first stretch of a task on a cpu only starts at its first
+ * preemption point, so the measurement errs on the short side there
+ */
+static void bn_stretch_end(void)
+{
+    struct bn_stretch *st = get_cpu_ptr(&bn_stretch);
+    unsigned long nsw = current->nvcsw + current->nivcsw;
+    u64 ns = ktime_get_ns() - st->start;
+    bool valid = st->task == current && st->nsw == nsw;
+    put_cpu_ptr(&bn_stretch);
+    if (!valid)
+        return;
+    unsigned long max = READ_ONCE(stretch_max_ns);
+    while (ns > max) {
+        unsigned long old = cmpxchg(&stretch_max_ns, max, ns);
+        if (old == max)
+            break;
+        max = old;
+    }
+    unsigned long budget = READ_ONCE(stretch_budget_ns);
+    if (budget && ns > budget)
+        printk_ratelimited(KERN_WARNING
+                           "fibdrv: %llu ns without a preemption point\n",
+                           ns);
+}
+
+static void bn_stretch_start(void)
+{
+    struct bn_stretch *st = get_cpu_ptr(&bn_stretch);
+    st->task = current;
+    st->nsw = current->nvcsw + current->nivcsw;
+    st->start = ktime_get_ns();
+    put_cpu_ptr(&bn_stretch);
+}
+
+void __bn_resched(void)
+{
+    bool measure = READ_ONCE(stretch_measure);
+    this_cpu_write(bn_work, 0);
+    if (measure)
+        bn_stretch_end();
+    cond_resched();
+    if (measure)
+        bn_stretch_start();
+}
+
+int bn_add(bn *a, const bn *b)
+{
+    return __bn_add(a, b);
+}
+
+int bn_add_to_smaller(bn *a, bn *b)
 {
     int cmp = bn_cmp(a, b);
     if (cmp >= 0) {
-        __bn_add(b, a);
+        return __bn_add(b, a);
     } else {
-        __bn_add(a, b);
+        return __bn_add(a, b);
     }
 }
 
-void __bn_add(struct list_head *shorter, struct list_head *longer)
+int __bn_add(bn *shorter, const bn *longer)
 {
-    int carry = 0;
-    bn_node *node;
-    struct list_head *longer_cur = longer->next;
-    list_for_each_entry (node, shorter, list) {
-        uint64_t tmp = node->val;
-        node->val += bn_node_val(longer_cur) + carry;
-        carry = U64_MAX - tmp >= bn_node_val(longer_cur) + carry ? 0 : 1;
-        longer_cur = longer_cur->next;
-        if (longer_cur == longer) {
-            break;
-        }
+    size_t len = longer->size;
+    size_t size = shorter->size > len ? shorter->size : len;
+    if (unlikely(bn_resize(shorter, size + 1)))
+        return -ENOMEM;
+    uint64_t *dst = shorter->digits;
+    const uint64_t *src = longer->digits;
+    uint64_t carry = 0;
+    size_t i = 0;
+    for (; i < len; i++) {
+        uint64_t tmp = dst[i] + carry;
+        carry = tmp < carry;
+        dst[i] = tmp + src[i];
+        carry += dst[i] < tmp;
     }
-    while (longer_cur != longer) {
-        uint64_t tmp = bn_node_val(longer_cur);
-        bn_newnode(shorter, bn_node_val(longer_cur) + carry);
-        carry = U64_MAX - tmp >= carry ? 0 : 1;
-        longer_cur = longer_cur->next;
-    }
-    while (carry) {
-        if (bn_size(shorter) > bn_size(longer)) {
-            uint64_t tmp = bn_node_val(node->list.next);
-            bn_node_val(node->list.next) += carry;
-            carry = U64_MAX - tmp >= carry ? 0 : 1;
-        } else {
-            bn_newnode(shorter, carry);
-            break;
-        }
+    for (; carry; i++) {
+        dst[i] += carry;
+        carry = !dst[i];
     }
+    bn_clean(shorter);
+    return 0;
 }
 
-void bn_sub(struct list_head *a, struct list_head *b)
+void bn_sub(bn *a, bn *b)
 {
     int cmp = bn_cmp(a, b);
     if (cmp >= 0) {
@@ -64,314 +179,1695 @@ void bn_sub(struct list_head *a, struct list_head *b)
     }
 }
 
-void __bn_sub(struct list_head *more, struct list_head *less)
+void __bn_sub(bn *more, const bn *less)
 {
-    int carry = 0;
-    bn_node *node;
-    struct list_head *less_cur = less->next;
-    list_for_each_entry (node, more, list) {
-        uint64_t tmp =
-            (less_cur == less) ? carry : bn_node_val(less_cur) + carry;
-        if (node->val >= tmp && likely(bn_node_val(less_cur) != U64_MAX - 1)) {
-            node->val -= tmp;
-            carry = 0;
-        } else {
-            node->val += (U64_MAX - tmp) + 1;
-            carry = 1;
+    uint64_t *dst = more->digits;
+    const uint64_t *src = less->digits;
+    uint64_t borrow = 0;
+    size_t i = 0;
+    for (; i < less->size; i++) {
+        uint64_t tmp = dst[i] - borrow;
+        borrow = tmp > dst[i];
+        borrow += tmp < src[i];
+        dst[i] = tmp - src[i];
+    }
+    for (; borrow && i < more->size; i++) {
+        borrow = !dst[i];
+        dst[i]--;
+    }
+    bn_clean(more);
+}
+
+/**
+ * limb_add: r = a + b, where a has n limbs and b has m limbs, n >= m
+ * r may be the same array as a or b
+ * @return: carry out of the most significant limb
+ */
+static uint64_t limb_add(uint64_t *r,
+                         const uint64_t *a,
+                         size_t n,
+                         const uint64_t *b,
+                         size_t m)
+{
+    uint64_t carry = 0;
+    size_t i = 0;
+    for (; i < m; i++) {
+        uint64_t tmp = a[i] + carry;
+        carry = tmp < carry;
+        r[i] = tmp + b[i];
+        carry += r[i] < tmp;
+    }
+    for (; i < n; i++) {
+        r[i] = a[i] + carry;
+        carry = r[i] < carry;
+    }
+    return carry;
+}
+
+/**
+ * limb_sub: r = a - b, where a has n limbs and b has m limbs, n >= m
+ * r may be the same array as a or b
+ * @return: borrow out of the most significant limb
+ */
+static uint64_t limb_sub(uint64_t *r,
+                         const uint64_t *a,
+                         size_t n,
+                         const uint64_t *b,
+                         size_t m)
+{
+    uint64_t borrow = 0;
+    size_t i = 0;
+    for (; i < m; i++) {
+        uint64_t val = b[i];
+        uint64_t tmp = a[i] - borrow;
+        borrow = tmp > a[i];
+        borrow += tmp < val;
+        r[i] = tmp - val;
+    }
+    for (; i < n; i++) {
+        uint64_t val = a[i];
+        r[i] = val - borrow;
+        borrow = r[i] > val;
+    }
+    return borrow;
+}
+
+/**
+ * limb_submul_1: r = r - x * c, where r has n limbs and x has m limbs
+ * @return: borrow out of the most significant limb
+ */
+static uint64_t limb_submul_1(uint64_t *r,
+                              size_t n,
+                              const uint64_t *x,
+                              size_t m,
+                              uint64_t c)
+{
+    uint64_t borrow = 0;
+    size_t i = 0;
+    for (; i < m; i++) {
+        uint128_t tmp = (uint128_t) x[i] * c + borrow;
+        uint64_t lo = tmp;
+        borrow = (tmp >> 64) + (r[i] < lo);
+        r[i] -= lo;
+    }
+    for (; borrow && i < n; i++) {
+        uint64_t val = r[i];
+        r[i] = val - borrow;
+        borrow = r[i] > val;
+    }
+    return borrow;
+}
+
+/**
+ * limb_cmp: compare two arrays of n limbs
+ * @return: 1 if a > b, 0 if a == b, -1 if a < b
+ */
+static int limb_cmp(const uint64_t *a, const uint64_t *b, size_t n)
+{
+    while (n-- > 0) {
+        if (a[n] != b[n])
+            return a[n] > b[n] ? 1 : -1;
+    }
+    return 0;
+}
+
+/**
+ * limb_rshift1: shift an array of n limbs right by one bit
+ */
+static void limb_rshift1(uint64_t *r, size_t n)
+{
+    for (size_t i = 0; i + 1 < n; i++)
+        r[i] = r[i] >> 1 | r[i + 1] << (val_size - 1);
+    r[n - 1] >>= 1;
+}
+
+/**
+ * limb_divexact_3: divide an array of n limbs by 3 in place
+ * The value must be a multiple of 3, which lets the quotient be found by
+ * multiplying with the inverse of 3 modulo 2^64 instead of dividing
+ */
+static void limb_divexact_3(uint64_t *r, size_t n)
+{
+    uint64_t carry = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t val = r[i] - carry;
+        carry = val > r[i];
+        r[i] = val * INV3;
+        carry += (uint64_t)(((uint128_t) r[i] * 3) >> 64);
+    }
+}
+
+/**
+ * limb_mul_basecase: schoolbook multiplication
+ * r = a * b, r has n + m limbs and should not overlap a or b
+ */
+static void limb_mul_basecase(uint64_t *r,
+                              const uint64_t *a,
+                              size_t n,
+                              const uint64_t *b,
+                              size_t m)
+{
+    memset(r, 0, sizeof(uint64_t) * (n + m));
+    for (size_t i = 0; i < n; i++) {
+        uint64_t carry = 0;
+        uint64_t val = a[i];
+        for (size_t j = 0; j < m; j++) {
+            uint128_t tmp = (uint128_t) val * b[j] + r[i + j] + carry;
+            r[i + j] = tmp;
+            carry = tmp >> 64;
         }
-        if (less_cur != less) {
-            less_cur = less_cur->next;
+        r[i + m] = carry;
+        bn_resched(m);
+    }
+}
+
+/**
+ * limb_sqr_basecase: schoolbook squaring
+ * Every cross product a[i] * a[j], i < j, is computed only once, the sum
+ * of them is doubled and the squares a[i]^2 are added in the same pass
+ * r = a ^ 2, r has 2n limbs and should not overlap a
+ */
+static void limb_sqr_basecase(uint64_t *r, const uint64_t *a, size_t n)
+{
+    memset(r, 0, sizeof(uint64_t) * 2 * n);
+    for (size_t i = 0; i + 1 < n; i++) {
+        uint64_t carry = 0;
+        uint64_t val = a[i];
+        for (size_t j = i + 1; j < n; j++) {
+            uint128_t tmp = (uint128_t) val * a[j] + r[i + j] + carry;
+            r[i + j] = tmp;
+            carry = tmp >> 64;
         }
+        r[i + n] = carry;
+        bn_resched(n - i);
     }
-    bn_node *last = list_last_entry(more, bn_node, list);
-    if (last->val == 0 && likely(!list_is_singular(more))) {
-        bn_size(more)--;
-        list_del(&last->list);
-        kfree(last);
+    // r = 2 * r + sum of a[i]^2 * B^2i
+    uint64_t carry = 0, top = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint128_t sq = (uint128_t) a[i] * a[i];
+        uint64_t lo = r[2 * i], hi = r[2 * i + 1];
+        uint128_t tmp = (uint128_t)(lo << 1 | top) + (uint64_t) sq + carry;
+        r[2 * i] = tmp;
+        tmp = (uint128_t)(hi << 1 | lo >> 63) + (uint64_t)(sq >> 64) +
+              (uint64_t)(tmp >> 64);
+        r[2 * i + 1] = tmp;
+        carry = tmp >> 64;
+        top = hi >> 63;
+    }
+    bn_resched(n);
+}
+
+static void limb_mul(uint64_t *r,
+                     const uint64_t *a,
+                     size_t n,
+                     const uint64_t *b,
+                     size_t m,
+                     uint64_t *tmp);
+
+/**
+ * limb_karatsuba: karatsuba multiplication
+ * a = a1 * B^h + a0, b = b1 * B^h + b0, h = ceil(n / 2)
+ * a * b = z2 * B^2h + (z1 - z2 - z0) * B^h + z0
+ * z0 = a0 * b0, z2 = a1 * b1, z1 = (a0 + a1) * (b0 + b1)
+ * n >= m > h is expected, r has n + m limbs
+ * @tmp: scratch space of at least limb_mul_scratch(n) limbs
+ */
+static void limb_karatsuba(uint64_t *r,
+                           const uint64_t *a,
+                           size_t n,
+                           const uint64_t *b,
+                           size_t m,
+                           uint64_t *tmp)
+{
+    size_t h = (n + 1) / 2;
+    size_t len = n + m - 2 * h;
+    uint64_t *sa = tmp, *sb = tmp + h + 1;
+    uint64_t *z1 = sb + h + 1, *next = z1 + 2 * h + 2;
+    // squaring only needs to evaluate one operand
+    if (a == b)
+        sb = sa;
+    limb_mul(r, a, h, b, h, next);
+    limb_mul(r + 2 * h, a + h, n - h, b + h, m - h, next);
+    sa[h] = limb_add(sa, a, h, a + h, n - h);
+    if (a != b)
+        sb[h] = limb_add(sb, b, h, b + h, m - h);
+    limb_mul(z1, sa, h + 1, sb, h + 1, next);
+    limb_sub(z1, z1, 2 * h + 2, r, 2 * h);
+    limb_sub(z1, z1, 2 * h + 2, r + 2 * h, len);
+    // z1 fits in the remaining limbs of the product
+    len = n + m - h < 2 * h + 2 ? n + m - h : 2 * h + 2;
+    limb_add(r + h, r + h, n + m - h, z1, len);
+}
+
+/**
+ * toom3_eval: evaluate x = x2 * B^2k + x1 * B^k + x0 at 1, -1 and 2
+ * Each result has k + 1 limbs, x(-1) is stored as its absolute value
+ * @return: 1 if x(-1) is negative, 0 otherwise
+ */
+static int toom3_eval(uint64_t *x1e,
+                      uint64_t *xm1,
+                      uint64_t *x2e,
+                      const uint64_t *x,
+                      size_t n,
+                      size_t k)
+{
+    const uint64_t *x0 = x, *x1 = x + k, *x2 = x + 2 * k;
+    size_t n2 = n - 2 * k;
+    int neg = 0;
+    // x0 + x2
+    x1e[k] = limb_add(x1e, x0, k, x2, n2);
+    // x(-1) = x0 + x2 - x1
+    if (x1e[k] || limb_cmp(x1e, x1, k) >= 0) {
+        xm1[k] = x1e[k] - limb_sub(xm1, x1e, k, x1, k);
+    } else {
+        limb_sub(xm1, x1, k, x1e, k);
+        xm1[k] = 0;
+        neg = 1;
     }
+    // x(1) = x0 + x2 + x1
+    limb_add(x1e, x1e, k + 1, x1, k);
+    // x(2) = ((x2 * 2) + x1) * 2 + x0
+    memcpy(x2e, x2, sizeof(uint64_t) * n2);
+    memset(x2e + n2, 0, sizeof(uint64_t) * (k + 1 - n2));
+    limb_add(x2e, x2e, k + 1, x2e, k + 1);
+    limb_add(x2e, x2e, k + 1, x1, k);
+    limb_add(x2e, x2e, k + 1, x2e, k + 1);
+    limb_add(x2e, x2e, k + 1, x0, k);
+    return neg;
 }
 
-void bn_mul(struct list_head *a, struct list_head *b, struct list_head *c)
+/**
+ * limb_toom3: toom-cook 3-way multiplication
+ * Split a and b into three parts of k = ceil(n / 3) limbs, evaluate them
+ * at 0, 1, -1, 2 and infinity, multiply pointwise and interpolate back
+ * n >= m > 2k is expected, r has n + m limbs
+ * @tmp: scratch space of at least limb_mul_scratch(n) limbs
+ */
+static void limb_toom3(uint64_t *r,
+                       const uint64_t *a,
+                       size_t n,
+                       const uint64_t *b,
+                       size_t m,
+                       uint64_t *tmp)
 {
-    bn_node *node;
-    // zeroing c
-    list_for_each_entry (node, c, list) {
-        node->val = 0;
+    size_t k = (n + 2) / 3, w = 2 * k + 2;
+    size_t len = n + m - 4 * k;
+    uint64_t *a1e = tmp, *am1 = a1e + k + 1, *a2e = am1 + k + 1;
+    uint64_t *b1e = a2e + k + 1, *bm1 = b1e + k + 1, *b2e = bm1 + k + 1;
+    uint64_t *v1 = b2e + k + 1, *vm1 = v1 + w, *v2 = vm1 + w;
+    uint64_t *next = v2 + w;
+    int neg = toom3_eval(a1e, am1, a2e, a, n, k);
+    // squaring only needs to evaluate one operand
+    if (a == b) {
+        b1e = a1e;
+        bm1 = am1;
+        b2e = a2e;
+        neg = 0;
+    } else {
+        neg ^= toom3_eval(b1e, bm1, b2e, b, m, k);
     }
-    // append c to match size of b
-    for (int diff = bn_size(b) - bn_size(c); diff > 0; diff--) {
-        bn_newnode(c, 0);
+    // r0 = v0 = a0 * b0, r4 = vinf = a2 * b2
+    limb_mul(r, a, k, b, k, next);
+    limb_mul(r + 4 * k, a + 2 * k, n - 2 * k, b + 2 * k, m - 2 * k, next);
+    limb_mul(v1, a1e, k + 1, b1e, k + 1, next);
+    limb_mul(vm1, am1, k + 1, bm1, k + 1, next);
+    limb_mul(v2, a2e, k + 1, b2e, k + 1, next);
+    // interpolation, every intermediate value is non-negative
+    // r1 + r3 = (v1 - vm1) / 2
+    if (neg)
+        limb_add(vm1, v1, w, vm1, w);
+    else
+        limb_sub(vm1, v1, w, vm1, w);
+    limb_rshift1(vm1, w);
+    // r2 = v1 - (r1 + r3) - r0 - r4
+    limb_sub(v1, v1, w, vm1, w);
+    limb_sub(v1, v1, w, r, 2 * k);
+    limb_sub(v1, v1, w, r + 4 * k, len);
+    // r1 + 4 * r3 = (v2 - r0 - 4 * r2 - 16 * r4) / 2
+    limb_sub(v2, v2, w, r, 2 * k);
+    limb_submul_1(v2, w, v1, w, 4);
+    limb_submul_1(v2, w, r + 4 * k, len, 16);
+    limb_rshift1(v2, w);
+    // r3 = ((r1 + 4 * r3) - (r1 + r3)) / 3
+    limb_sub(v2, v2, w, vm1, w);
+    limb_divexact_3(v2, w);
+    // r1 = (r1 + r3) - r3
+    limb_sub(vm1, vm1, w, v2, w);
+    // recomposition
+    memset(r + 2 * k, 0, sizeof(uint64_t) * 2 * k);
+    for (int i = 1; i < 4; i++) {
+        uint64_t *coef = i == 1 ? vm1 : i == 2 ? v1 : v2;
+        size_t rest = n + m - i * k;
+        limb_add(r + i * k, r + i * k, rest, coef, rest < w ? rest : w);
     }
-    bn_node *node_a, *node_b;
-    struct list_head *base = c->next;
-    list_for_each_entry (node_a, a, list) {
-        uint64_t carry = 0;
-        struct list_head *cur = base;
-        list_for_each_entry (node_b, b, list) {
-            uint128_t tmp = (uint128_t) node_b->val * (uint128_t) node_a->val;
-            uint64_t n_carry = tmp >> 64;
-            if (U64_MAX - bn_node_val(cur) < tmp << 64 >> 64)
-                n_carry++;
-            bn_node_val(cur) += tmp;
-            if (U64_MAX - bn_node_val(cur) < carry)
-                n_carry++;
-            bn_node_val(cur) += carry;
-            carry = n_carry;
-            cur = cur->next;
-            if (cur == c) {
-                break;
+}
+
+/**
+ * limb_mul_unbalanced: multiply operands whose sizes differ too much to
+ * be split evenly, by slicing the longer one into pieces of m limbs
+ * n >= m is expected, r has n + m limbs
+ * @tmp: scratch space of at least limb_mul_scratch(n) limbs
+ */
+static void limb_mul_unbalanced(uint64_t *r,
+                                const uint64_t *a,
+                                size_t n,
+                                const uint64_t *b,
+                                size_t m,
+                                uint64_t *tmp)
+{
+    uint64_t *prod = tmp, *next = tmp + 2 * m;
+    limb_mul(r, a, m, b, m, next);
+    memset(r + 2 * m, 0, sizeof(uint64_t) * (n - m));
+    for (size_t i = m; i < n; i += m) {
+        size_t len = n - i < m ? n - i : m;
+        limb_mul(prod, a + i, len, b, m, next);
+        limb_add(r + i, r + i, n + m - i, prod, len + m);
+    }
+}
+
+/**
+ * limb_mul_scratch: number of scratch limbs needed by limb_mul
+ * Every level of recursion uses less than 4n + 32 limbs and at least
+ * halves the operands, so the sum is bounded by 8n plus a constant
+ * @n: size of the longer operand
+ */
+static inline size_t limb_mul_scratch(size_t n)
+{
+    return 8 * n + 32 * val_size;
+}
+
+/**
+ * limb_mul: multiply two arrays of limbs, choosing the algorithm by size
+ * Squaring is detected when a and b are the same array of the same size
+ * r has n + m limbs and should not overlap a or b
+ */
+static void limb_mul(uint64_t *r,
+                     const uint64_t *a,
+                     size_t n,
+                     const uint64_t *b,
+                     size_t m,
+                     uint64_t *tmp)
+{
+    if (n < m) {
+        const uint64_t *t = a;
+        size_t s = n;
+        a = b;
+        b = t;
+        n = m;
+        m = s;
+    }
+    if (a == b && n == m && m < SQR_KARATSUBA_THRESHOLD)
+        limb_sqr_basecase(r, a, n);
+    else if (m < KARATSUBA_THRESHOLD)
+        limb_mul_basecase(r, a, n, b, m);
+    else if (m >= TOOM3_THRESHOLD && m > 2 * ((n + 2) / 3))
+        limb_toom3(r, a, n, b, m, tmp);
+    else if (m > (n + 1) / 2)
+        limb_karatsuba(r, a, n, b, m, tmp);
+    else
+        limb_mul_unbalanced(r, a, n, b, m, tmp);
+}
+
+typedef void (*limb_mul_fn)(uint64_t *,
+                            const uint64_t *,
+                            size_t,
+                            const uint64_t *,
+                            size_t,
+                            uint64_t *);
+
+/**
+ * bn_mul_with: multiply two bns with the given top level algorithm
+ * Falls back to limb_mul if the operands are too small or too unbalanced
+ * for the algorithm to split them
+ * c = a * b, c should not be the same bn as a or b
+ * @s: working memory, allocated on demand if NULL or too small
+ */
+static int bn_mul_with(const bn *a,
+                       const bn *b,
+                       bn *c,
+                       limb_mul_fn fn,
+                       bn_scratch *s)
+{
+    size_t n = a->size, m = b->size;
+    if (n < m) {
+        const bn *t = a;
+        a = b;
+        b = t;
+        n = m;
+        m = b->size;
+    }
+    if (a == b && m < SQR_KARATSUBA_THRESHOLD)
+        return bn_sqr(a, c);
+    if (m < KARATSUBA_THRESHOLD)
+        return bn_mul(a, b, c);
+    if ((fn == limb_toom3 && m <= 2 * ((n + 2) / 3)) ||
+        (fn == limb_karatsuba && m <= (n + 1) / 2))
+        fn = limb_mul;
+    uint64_t *tmp = NULL, *own = NULL;
+    if (s && s->tmp_size >= limb_mul_scratch(n)) {
+        tmp = s->tmp;
+    } else {
+        tmp = own =
+            kmalloc(sizeof(uint64_t) * limb_mul_scratch(n), GFP_KERNEL);
+        bn_count_alloc();
+    }
+    // c is emptied so that growing it copies nothing, and set to zero if
+    // it cannot grow
+    c->size = 0;
+    if (!tmp || bn_resize(c, n + m)) {
+        printk(KERN_ERR "bn_mul_with: memory allocation failed\n");
+        bn_set(c, 0);
+        kfree(own);
+        return -ENOMEM;
+    }
+    fn(c->digits, a->digits, n, b->digits, m, tmp);
+    bn_clean(c);
+    kfree(own);
+    return 0;
+}
+
+int bn_mul(const bn *a, const bn *b, bn *c)
+{
+    if (a == b)
+        return bn_sqr(a, c);
+    size_t a_size = a->size, b_size = b->size;
+    c->size = 0;
+    if (unlikely(bn_resize(c, a_size + b_size))) {
+        bn_set(c, 0);
+        return -ENOMEM;
+    }
+    limb_mul_basecase(c->digits, a->digits, a_size, b->digits, b_size);
+    bn_clean(c);
+    return 0;
+}
+
+int bn_sqr(const bn *a, bn *c)
+{
+    size_t a_size = a->size;
+    c->size = 0;
+    if (unlikely(bn_resize(c, 2 * a_size))) {
+        bn_set(c, 0);
+        return -ENOMEM;
+    }
+    limb_sqr_basecase(c->digits, a->digits, a_size);
+    bn_clean(c);
+    return 0;
+}
+
+int bn_karatsuba(const bn *a, const bn *b, bn *c)
+{
+    return bn_mul_with(a, b, c, limb_karatsuba, NULL);
+}
+
+int bn_sqr_karatsuba(const bn *a, bn *c)
+{
+    return bn_mul_with(a, a, c, limb_karatsuba, NULL);
+}
+
+int bn_toom3(const bn *a, const bn *b, bn *c)
+{
+    return bn_mul_with(a, b, c, limb_toom3, NULL);
+}
+
+int bn_sqr_toom3(const bn *a, bn *c)
+{
+    return bn_mul_with(a, a, c, limb_toom3, NULL);
+}
+
+static int bn_crt_mul(bn *a, bn *b, bn *c, bn_scratch *s);
+
+static bn_scratch *__bn_scratch_new(size_t tmp_size, size_t crt_size)
+{
+    bn_scratch *s = kzalloc(sizeof(bn_scratch), GFP_KERNEL);
+    if (!s)
+        return NULL;
+    bn_count_alloc();
+    s->tmp_size = tmp_size;
+    if (tmp_size) {
+        s->tmp = kvmalloc_array(tmp_size, sizeof(uint64_t), GFP_KERNEL);
+        bn_count_alloc();
+    }
+    s->crt_size = crt_size;
+    if (crt_size) {
+        s->crt = kvmalloc_array(crt_size, sizeof(uint64_t), GFP_KERNEL);
+        bn_count_alloc();
+    }
+    if ((tmp_size && !s->tmp) || (crt_size && !s->crt)) {
+        printk(KERN_ERR "bn_scratch_new: memory allocation failed\n");
+        bn_scratch_free(s);
+        return NULL;
+    }
+    return s;
+}
+
+bn_scratch *bn_scratch_new(size_t n)
+{
+    // the residues of every prime and the transform of one operand
+    size_t crt_size = n >= NTT_THRESHOLD
+                          ? (NTT_PRIMES + 1) * nextpow2(2 * n * crt_per_size)
+                          : 0;
+    return __bn_scratch_new(limb_mul_scratch(n), crt_size);
+}
+
+bn_scratch *bn_scratch_new_doubling(size_t n)
+{
+    // the residues of both results for every prime
+    return __bn_scratch_new(0,
+                            2 * NTT_PRIMES * nextpow2(2 * n * crt_per_size));
+}
+
+void bn_scratch_free(bn_scratch *s)
+{
+    if (!s)
+        return;
+    kvfree(s->tmp);
+    kvfree(s->crt);
+    kfree(s);
+}
+
+int bn_fast_mul(bn *a, bn *b, bn *c, bn_scratch *s)
+{
+    u64 ts = fib_trace_start(trace_fib_mul_enabled());
+    size_t a_size = bn_size(a), b_size = bn_size(b);
+    bool crt = a_size >= NTT_THRESHOLD && b_size >= NTT_THRESHOLD;
+    int rc = crt ? bn_crt_mul(a, b, c, s) : bn_mul_with(a, b, c, limb_mul, s);
+    // c may be a or b
+    trace_fib_mul(crt ? FIB_MUL_CRT : FIB_MUL_LIMB, a_size, b_size,
+                  fib_trace_ns(ts));
+    return rc;
+}
+
+int bn_fast_sqr(bn *a, bn *c, bn_scratch *s)
+{
+    u64 ts = fib_trace_start(trace_fib_mul_enabled());
+    size_t a_size = bn_size(a);
+    bool crt = a_size >= NTT_THRESHOLD;
+    int rc = crt ? bn_crt_mul(a, a, c, s) : bn_mul_with(a, a, c, limb_mul, s);
+    trace_fib_mul(crt ? FIB_MUL_CRT : FIB_MUL_LIMB, a_size, a_size,
+                  fib_trace_ns(ts));
+    return rc;
+}
+
+/**
+ * bn_from_chunks: pack an array of carried chunks back to a bn
+ * @c: result bn
+ * @array: array of chunks, each within bits
+ * @size: length of array
+ * @carry: carry out of the last chunk
+ * @bits: number of bits in a chunk
+ * @return: 0 on success, -ENOMEM if failed to allocate memory, c is zero
+ * then
+ */
+static int bn_from_chunks(bn *c,
+                          const uint64_t *array,
+                          int size,
+                          uint64_t carry,
+                          int bits)
+{
+    int per_limb = val_size / bits;
+    uint64_t bits_mask = (1ULL << bits) - 1;
+    // the transforms are zero padded, only grow c to the actual length
+    if (!carry)
+        while (size > 1 && !array[size - 1])
+            size--;
+    c->size = 0;
+    if (unlikely(bn_resize(c, (size + per_limb - 1) / per_limb + 1))) {
+        bn_set(c, 0);
+        return -ENOMEM;
+    }
+    int i = 0;
+    for (size_t k = 0; k < c->size; k++) {
+        // per_limb at a time : bits to uint64_t
+        uint64_t val = 0;
+        for (int j = 0; j < val_size; j += bits) {
+            if (i < size) {
+                val |= array[i++] << j;
+            } else if (carry) {
+                val |= (carry & bits_mask) << j;
+                carry >>= bits;
             }
         }
-        while (carry) {
-            if (cur == c) {
-                bn_newnode(c, carry);
-                break;
-            }
-            uint64_t tmp = bn_node_val(cur);
-            bn_node_val(cur) += carry;
-            carry = U64_MAX - tmp >= carry ? 0 : 1;
-            cur = cur->next;
+        c->digits[k] = val;
+    }
+    bn_resched(size);
+    bn_clean(c);
+    return 0;
+}
+
+/**
+ * chunks_carry - a carry propagation split into parts
+ * Each part carries its own chunks starting from no carry, then
+ * chunks_carry_fix passes the carry out of a part on to the next one
+ * @array: chunks to be carried
+ * @res: residues modulo each prime for bn_crt_combine, NULL otherwise
+ * @size: length of array
+ * @carry: carry out of each part
+ */
+struct chunks_carry {
+    uint64_t *array;
+    uint64_t **res;
+    int size;
+    uint128_t carry[NTT_PAR_MAX];
+};
+
+/**
+ * chunks_carry_fix: add the carry out of each part to the next part
+ * A carry dies out within a few chunks unless they are all ones, so this
+ * is short compared with the parts
+ * @cc: carried parts
+ * @nr: number of parts
+ * @bits: number of bits in a chunk
+ * @return: carry out of the last chunk
+ */
+static uint128_t chunks_carry_fix(struct chunks_carry *cc, int nr, int bits)
+{
+    const uint64_t chunk = (1ULL << bits) - 1;
+    int len = cc->size / nr;
+    for (int t = 1; t < nr; t++) {
+        uint128_t carry = cc->carry[t - 1];
+        for (int i = t * len; carry && i < (t + 1) * len; i++) {
+            carry += cc->array[i];
+            cc->array[i] = carry & chunk;
+            carry >>= bits;
         }
-        base = base->next;
+        cc->carry[t] += carry;
+    }
+    return cc->carry[nr - 1];
+}
+
+static void bn_carry_part(void *arg, int i, int nr)
+{
+    struct chunks_carry *cc = arg;
+    int len = cc->size / nr;
+    uint64_t *array = cc->array + i * len;
+    uint64_t carry = 0;
+    for (int j = 0; j < len; j++) {
+        array[j] += carry;
+        carry = array[j] >> chunck_size;
+        array[j] &= chunk_mask;
     }
+    bn_resched(len);
+    cc->carry[i] = carry;
 }
 
-void bn_strassen(struct list_head *a, struct list_head *b, struct list_head *c)
+/**
+ * bn_carry: carry the coefficients of a product into chunks of chunck_size
+ * bits, split between the ntt workers for long transforms
+ * @array: coefficients of the product
+ * @size: length of array, a power of 2
+ * @return: carry out of the last chunk
+ */
+static uint64_t bn_carry(uint64_t *array, int size)
+{
+    struct chunks_carry cc = {.array = array, .size = size};
+    int nr = ntt_parts(size);
+    ntt_par_run(bn_carry_part, &cc, nr);
+    return chunks_carry_fix(&cc, nr, chunck_size);
+}
+
+int bn_strassen(bn *a, bn *b, bn *c)
 {
     if (!a || !b || !c) {
         printk(KERN_ERR "bn_strassen: invalid input\n");
-        return;
+        return -EINVAL;
     }
-    int a_size = bn_size(a) * per_size - CLZ(bn_last_val(a)) / chunck_size;
-    int b_size = bn_size(b) * per_size - CLZ(bn_last_val(b)) / chunck_size;
+    bn_clean(a);
+    bn_clean(b);
+    int a_size = bn_size(a) * per_size -
+                 (bn_last_val(a) ? CLZ(bn_last_val(a)) / chunck_size : 0);
+    int b_size = bn_size(b) * per_size -
+                 (bn_last_val(b) ? CLZ(bn_last_val(b)) / chunck_size : 0);
     // could not do ntt if size is too small
-    if (a_size < 2 || b_size < 2) {
-        bn_mul(a, b, c);
-        return;
-    }
+    if (a_size < 2 || b_size < 2)
+        return bn_mul(a, b, c);
+    // the coefficients would overflow mod
+    if (min(a_size, b_size) > STRASSEN_MAX_CHUNKS)
+        return bn_fast_mul(a, b, c, NULL);
     // zero padding
     int size = nextpow2((uint64_t)(a_size + b_size - 1));
-    printk(KERN_INFO "bn_strassen: size = %d, a:%i, b:%i\n", size, a_size,
-           b_size);
+    u64 ts = fib_trace_start(trace_fib_mul_enabled());
+    const struct ntt_table *tbl = ntt_table_get(size, 0);
     uint64_t *a_array = bn_split(a, size);
     uint64_t *b_array = bn_split(b, size);
-    if (!a_array || !b_array) {
+    if (!tbl || !a_array || !b_array) {
         printk(KERN_ERR "bn_strassen: memory allocation failed\n");
-        return;
+        kfree(a_array);
+        kfree(b_array);
+        bn_set(c, 0);
+        return -ENOMEM;
     }
     // number theoretic transform
-    ntt(a_array, size, mod, rou);
-    ntt(b_array, size, mod, rou);
+    ntt(a_array, tbl);
+    ntt(b_array, tbl);
     // pointwise multiplication
-    for (int i = 0; i < size; i++) {
-        a_array[i] *= b_array[i] % mod;
-    }
+    ntt_pointwise(a_array, b_array, tbl);
     // inverse ntt
-    intt(a_array, size, mod, rou);
+    intt(a_array, tbl);
     // carrying
-    uint64_t carry = 0;
-    for (int i = 0; i < size; i++) {
-        a_array[i] += carry;
-        carry = a_array[i] >> chunck_size;
-        a_array[i] &= chunk_mask;
-    }
+    uint64_t carry = bn_carry(a_array, size);
     // convert to bn
-    for (; bn_size(c) < size / per_size;) {
-        bn_newnode(c, 0);
-    }
-    bn_node *node;
-    int i = 0;
-    list_for_each_entry (node, c, list) {
-        // four at a time : 8 bits to uint64_t
-        uint64_t val = 0;
-        for (int j = 0; j < val_size; j += chunck_size) {
-            if (i < size) {
-                val |= a_array[i++] << j;
-            } else if (carry) {
-                val |= (carry & chunk_mask) << j;
-                carry >>= chunck_size;
-            }
-        }
-        node->val = val;
-    }
-    if (carry) {
-        bn_newnode(c, carry);
-    }
-    bn_clean(c);
+    int rc = bn_from_chunks(c, a_array, size, carry, chunck_size);
     kfree(a_array);
     kfree(b_array);
+    trace_fib_mul(FIB_MUL_STRASSEN, bn_size(a), bn_size(b), fib_trace_ns(ts));
+    return rc;
 }
 
-void bn_sqr_strassen(struct list_head *a, struct list_head *c)
+int bn_sqr_strassen(bn *a, bn *c)
 {
     if (!a || !c) {
         printk(KERN_ERR "bn_strassen: invalid input\n");
-        return;
+        return -EINVAL;
     }
-    int a_size = bn_size(a) * per_size - CLZ(bn_last_val(a)) / chunck_size;
+    bn_clean(a);
+    int a_size = bn_size(a) * per_size -
+                 (bn_last_val(a) ? CLZ(bn_last_val(a)) / chunck_size : 0);
     // could not do ntt if size is too small
-    if (a_size < 2) {
-        bn_mul(a, a, c);
-        return;
-    }
+    if (a_size < 2)
+        return bn_mul(a, a, c);
+    // the coefficients would overflow mod
+    if (a_size > STRASSEN_MAX_CHUNKS)
+        return bn_fast_sqr(a, c, NULL);
     // zero padding
     int size = nextpow2((uint64_t)(2 * a_size - 1));
-    printk(KERN_INFO "bn_sqr_strassen: size = %d, a:%i\n", size, a_size);
+    u64 ts = fib_trace_start(trace_fib_mul_enabled());
+    const struct ntt_table *tbl = ntt_table_get(size, 0);
     uint64_t *a_array = bn_split(a, size);
-    if (!a_array) {
+    if (!tbl || !a_array) {
         printk(KERN_ERR "bn_strassen: memory allocation failed\n");
-        return;
+        kfree(a_array);
+        bn_set(c, 0);
+        return -ENOMEM;
     }
     // number theoretic transform
-    ntt(a_array, size, mod, rou);
+    ntt(a_array, tbl);
     // pointwise multiplication
-    for (int i = 0; i < size; i++) {
-        a_array[i] *= a_array[i] % mod;
-    }
+    ntt_pointwise(a_array, a_array, tbl);
     // inverse ntt
-    intt(a_array, size, mod, rou);
+    intt(a_array, tbl);
     // carrying
-    uint64_t carry = 0;
-    for (int i = 0; i < size; i++) {
-        a_array[i] += carry;
-        carry = a_array[i] >> chunck_size;
-        a_array[i] &= chunk_mask;
+    uint64_t carry = bn_carry(a_array, size);
+    // convert to bn
+    int rc = bn_from_chunks(c, a_array, size, carry, chunck_size);
+    kfree(a_array);
+    trace_fib_mul(FIB_MUL_STRASSEN, bn_size(a), bn_size(a), fib_trace_ns(ts));
+    return rc;
+}
+
+/**
+ * bn_split_crt: split a bn into chuncks of crt_chunk_size bits reduced
+ * modulo a prime
+ * A chunk may exceed 2p for the smaller primes, while ntt expects its
+ * inputs below 2p
+ * @num: bn to be converted
+ * @res: array to store the chunks
+ * @size: length of res
+ * @p: prime of the transform
+ */
+static void bn_split_crt(const bn *num, uint64_t *res, int size, uint64_t p)
+{
+    memset(res, 0, sizeof(uint64_t) * size);
+    int i = 0;
+    for (size_t k = 0; k < num->size; k++) {
+        uint64_t val = num->digits[k];
+        for (int j = 0; j < val_size && i < size; j += crt_chunk_size)
+            res[i++] = ((val >> j) & crt_chunk_mask) % p;
+    }
+    bn_resched(size);
+}
+
+/**
+ * bn_crt_size: number of 32-bit chunks needed to hold a bn
+ * @num: bn to be measured, expected to be cleaned
+ * @return: number of chunks
+ */
+static int bn_crt_size(const bn *num)
+{
+    return bn_size(num) * crt_per_size -
+           (bn_last_val(num) ? CLZ(bn_last_val(num)) / crt_chunk_size : 0);
+}
+
+static void bn_crt_combine_part(void *arg, int i, int nr)
+{
+    const uint64_t inv01 = fast_pow(NTT_P0 % NTT_P1, NTT_P1 - 2, NTT_P1);
+    const uint64_t inv02 = fast_pow(NTT_P0 % NTT_P2, NTT_P2 - 2, NTT_P2);
+    const uint64_t inv12 = fast_pow(NTT_P1 % NTT_P2, NTT_P2 - 2, NTT_P2);
+    struct chunks_carry *cc = arg;
+    uint64_t **res = cc->res;
+    int len = cc->size / nr;
+    uint128_t carry = 0;
+    for (int j = i * len; j < (i + 1) * len; j++) {
+        uint64_t r0 = res[0][j], r1 = res[1][j], r2 = res[2][j];
+        uint64_t v1 = (r1 + NTT_P1 - r0 % NTT_P1) % NTT_P1 * inv01 % NTT_P1;
+        uint64_t v2 = (r2 + NTT_P2 - r0 % NTT_P2) % NTT_P2 * inv02 % NTT_P2;
+        v2 = (v2 + NTT_P2 - v1 % NTT_P2) % NTT_P2 * inv12 % NTT_P2;
+        carry += r0 + (uint128_t) NTT_P0 * (v1 + NTT_P1 * v2);
+        res[0][j] = carry & crt_chunk_mask;
+        carry >>= crt_chunk_size;
+        // the divisions make a coefficient worth many limb operations
+        bn_resched(16);
     }
+    cc->carry[i] = carry;
+}
+
+/**
+ * bn_crt_combine: recover the coefficients from their residues and carry
+ * Garner's algorithm, the coefficients are expected to be below
+ * NTT_P0 * NTT_P1 * NTT_P2. Split between the ntt workers for long
+ * transforms.
+ * @c: result bn
+ * @res: residues modulo each prime, res[0] is overwritten
+ * @size: number of coefficients, a power of 2
+ * @return: 0 on success, -ENOMEM if failed to allocate memory
+ */
+static int bn_crt_combine(bn *c, uint64_t **res, int size)
+{
+    struct chunks_carry cc = {.array = res[0], .res = res, .size = size};
+    int nr = ntt_parts(size);
+    ntt_par_run(bn_crt_combine_part, &cc, nr);
+    uint128_t carry = chunks_carry_fix(&cc, nr, crt_chunk_size);
     // convert to bn
-    for (; bn_size(c) < size / per_size;) {
-        bn_newnode(c, 0);
+    return bn_from_chunks(c, res[0], size, carry, crt_chunk_size);
+}
+
+/**
+ * bn_crt_mul: multiply two bns with transforms over NTT_PRIMES primes
+ * A single prime limits chunks to 8 bits, while the three residues of a
+ * coefficient recover convolutions up to 2^89, so each chunk carries 32
+ * bits and the transforms are four times shorter.
+ * The coefficients are recombined by Garner's algorithm:
+ * x = r0 + p0 * (v1 + p1 * v2)
+ * v1 = (r1 - r0) / p0 mod p1
+ * v2 = ((r2 - r0) / p0 - v1) / p1 mod p2
+ * c = a * b, b may be the same bn as a to square it
+ * @a: first bn
+ * @b: second bn
+ * @c: result bn
+ * @s: working memory, allocated on demand if NULL or too small
+ * @return: 0 on success, -ENOMEM if failed to allocate memory, c is zero
+ * then
+ */
+static int bn_crt_mul(bn *a, bn *b, bn *c, bn_scratch *s)
+{
+    bn_clean(a);
+    bn_clean(b);
+    int a_size = bn_crt_size(a);
+    int b_size = bn_crt_size(b);
+    // could not do ntt if size is too small
+    if (a_size < 2 || b_size < 2)
+        return bn_mul(a, b, c);
+    // zero padding
+    int size = nextpow2((uint64_t)(a_size + b_size - 1));
+    const struct ntt_table *tbl[NTT_PRIMES];
+    uint64_t *res[NTT_PRIMES];
+    uint64_t *buf = NULL, *own = NULL;
+    // the residues of every prime, followed by the transform of b
+    if (s && s->crt_size >= (size_t)(NTT_PRIMES + 1) * size) {
+        buf = s->crt;
+    } else {
+        buf = own = kvmalloc_array((NTT_PRIMES + 1) * size, sizeof(uint64_t),
+                                   GFP_KERNEL);
+        bn_count_alloc();
     }
-    bn_node *node;
-    int i = 0;
-    list_for_each_entry (node, c, list) {
-        // four at a time : 8 bits to uint64_t
-        uint64_t val = 0;
-        for (int j = 0; j < val_size; j += chunck_size) {
-            if (i < size) {
-                val |= a_array[i++] << j;
-            } else if (carry) {
-                val |= (carry & chunk_mask) << j;
-                carry >>= chunck_size;
-            }
+    int failed = !buf;
+    for (int i = 0; i < NTT_PRIMES; i++) {
+        tbl[i] = ntt_table_get(size, i);
+        res[i] = buf + i * size;
+        failed |= !tbl[i];
+    }
+    int rc = -ENOMEM;
+    if (failed) {
+        printk(KERN_ERR "bn_crt_mul: memory allocation failed\n");
+        bn_set(c, 0);
+        goto out;
+    }
+    uint64_t *b_array = buf + NTT_PRIMES * size;
+    // one product per prime, the operand buffer is reused between them
+    for (int i = 0; i < NTT_PRIMES; i++) {
+        bn_split_crt(a, res[i], size, tbl[i]->p);
+        ntt(res[i], tbl[i]);
+        if (a == b) {
+            ntt_pointwise(res[i], res[i], tbl[i]);
+        } else {
+            bn_split_crt(b, b_array, size, tbl[i]->p);
+            ntt(b_array, tbl[i]);
+            ntt_pointwise(res[i], b_array, tbl[i]);
         }
-        node->val = val;
+        intt(res[i], tbl[i]);
     }
-    if (carry) {
-        bn_newnode(c, carry);
+    // chinese remainder theorem and carrying
+    rc = bn_crt_combine(c, res, size);
+out:
+    kvfree(own);
+    return rc;
+}
+
+int bn_strassen_crt(bn *a, bn *b, bn *c)
+{
+    if (!a || !b || !c) {
+        printk(KERN_ERR "bn_strassen_crt: invalid input\n");
+        return -EINVAL;
     }
-    bn_clean(c);
-    kfree(a_array);
+    return bn_crt_mul(a, b, c, NULL);
 }
 
-void bn_lshift(struct list_head *head, int bit)
+int bn_sqr_strassen_crt(bn *a, bn *c)
 {
-    int tmp = bit;
-    for (; tmp > 64; tmp -= 63) {
-        __bn_lshift(head, 63);
+    if (!a || !c) {
+        printk(KERN_ERR "bn_strassen_crt: invalid input\n");
+        return -EINVAL;
     }
-    __bn_lshift(head, tmp);
+    return bn_crt_mul(a, a, c, NULL);
 }
 
-void __bn_lshift(struct list_head *head, int bit)
+int bn_doubling_strassen(bn *a, bn *b, bn *c, bn *d, bn_scratch *s)
 {
-    uint64_t carry = 0;
-    bn_node *node;
-    list_for_each_entry (node, head, list) {
-        uint64_t tmp = node->val;
-        node->val <<= bit;
-        node->val |= carry;
-        carry = tmp >> (64 - bit);
+    if (!a || !b || !c || !d) {
+        printk(KERN_ERR "bn_doubling_strassen: invalid input\n");
+        return -EINVAL;
     }
-    if (carry) {
-        bn_newnode(head, carry);
+    u64 ts = fib_trace_start(trace_fib_mul_enabled());
+    bn_clean(a);
+    bn_clean(b);
+    int a_size = bn_crt_size(a);
+    int b_size = bn_crt_size(b);
+    int n_size = a_size > b_size ? a_size : b_size;
+    // every coefficient of b * (2a + b) is below 3 * n_size * 2^64, which
+    // must stay below the product of the primes
+    if (a_size < 2 || n_size > 1 << (NTT_MAX_LOG - 1)) {
+        bn *t = bn_alloc(bn_size(b) + 1);
+        if (!t) {
+            printk(KERN_ERR
+                   "bn_doubling_strassen: memory allocation failed\n");
+            return -ENOMEM;
+        }
+        // d = b * (2a + b), c = a^2 + b^2
+        int rc = -ENOMEM;
+        if (!bn_copy(t, a) && !bn_lshift(t, 1) && !bn_add(t, b) &&
+            !bn_crt_mul(b, t, d, s) && !bn_crt_mul(a, a, c, s) &&
+            !bn_crt_mul(b, b, t, s) && !bn_add(c, t))
+            rc = 0;
+        if (rc) {
+            bn_set(c, 0);
+            bn_set(d, 0);
+        }
+        bn_free(t);
+        trace_fib_mul(FIB_MUL_DOUBLING, bn_size(a), bn_size(b),
+                      fib_trace_ns(ts));
+        return rc;
+    }
+    int size = nextpow2((uint64_t)(2 * n_size - 1));
+    const struct ntt_table *tbl[NTT_PRIMES];
+    uint64_t *c_res[NTT_PRIMES], *d_res[NTT_PRIMES];
+    uint64_t *buf = NULL, *own = NULL;
+    // the residues of c for every prime, followed by the ones of d
+    if (s && s->crt_size >= (size_t) 2 * NTT_PRIMES * size) {
+        buf = s->crt;
+    } else {
+        buf = own = kvmalloc_array(2 * NTT_PRIMES * size, sizeof(uint64_t),
+                                   GFP_KERNEL);
+        bn_count_alloc();
+    }
+    int failed = !buf;
+    for (int i = 0; i < NTT_PRIMES; i++) {
+        tbl[i] = ntt_table_get(size, i);
+        c_res[i] = buf + i * size;
+        d_res[i] = buf + (NTT_PRIMES + i) * size;
+        failed |= !tbl[i];
+    }
+    int rc = -ENOMEM;
+    if (failed) {
+        printk(KERN_ERR "bn_doubling_strassen: memory allocation failed\n");
+        bn_set(c, 0);
+        bn_set(d, 0);
+        goto out;
+    }
+    // two forward and two inverse transforms per prime instead of five and
+    // three, both products are formed from the same pair of transforms
+    for (int i = 0; i < NTT_PRIMES; i++) {
+        bn_split_crt(a, c_res[i], size, tbl[i]->p);
+        bn_split_crt(b, d_res[i], size, tbl[i]->p);
+        ntt(c_res[i], tbl[i]);
+        ntt(d_res[i], tbl[i]);
+        ntt_pointwise_doubling(c_res[i], d_res[i], tbl[i]);
+        intt(c_res[i], tbl[i]);
+        intt(d_res[i], tbl[i]);
+    }
+    rc = bn_crt_combine(c, c_res, size);
+    if (!rc)
+        rc = bn_crt_combine(d, d_res, size);
+    trace_fib_mul(FIB_MUL_DOUBLING, bn_size(a), bn_size(b), fib_trace_ns(ts));
+out:
+    kvfree(own);
+    return rc;
+}
+
+/**
+ * limb_mullo: r = a * b mod 2^(64n), the low n limbs of the product
+ * r should not overlap a or b
+ */
+static void limb_mullo(uint64_t *r,
+                       const uint64_t *a,
+                       const uint64_t *b,
+                       size_t n)
+{
+    memset(r, 0, sizeof(uint64_t) * n);
+    for (size_t i = 0; i < n; i++) {
+        uint64_t carry = 0;
+        uint64_t val = a[i];
+        for (size_t j = 0; i + j < n; j++) {
+            uint128_t tmp = (uint128_t) val * b[j] + r[i + j] + carry;
+            r[i + j] = tmp;
+            carry = tmp >> 64;
+        }
+    }
+}
+
+/**
+ * limb_add_mod: r = a + b mod q, where a, b < q have n limbs
+ */
+static void limb_add_mod(uint64_t *r,
+                         const uint64_t *a,
+                         const uint64_t *b,
+                         const uint64_t *q,
+                         size_t n)
+{
+    if (limb_add(r, a, n, b, n) || limb_cmp(r, q, n) >= 0)
+        limb_sub(r, r, n, q, n);
+}
+
+/**
+ * limb_sub_mod: r = a - b mod q, where a, b < q have n limbs
+ */
+static void limb_sub_mod(uint64_t *r,
+                         const uint64_t *a,
+                         const uint64_t *b,
+                         const uint64_t *q,
+                         size_t n)
+{
+    if (limb_sub(r, a, n, b, n))
+        limb_add(r, r, n, q, n);
+}
+
+/**
+ * limb_mont_mul: montgomery multiplication r = a * b * 2^(-64n) mod q
+ * Each limb of b is multiplied in and then a multiple of q clearing the
+ * lowest limb is added, so the product never takes more than n + 2 limbs
+ * a, b < q have n limbs, q is odd, t has n + 2 limbs
+ * r may be the same array as a or b
+ * @qinv: -q^-1 mod 2^64
+ */
+static void limb_mont_mul(uint64_t *r,
+                          const uint64_t *a,
+                          const uint64_t *b,
+                          const uint64_t *q,
+                          uint64_t qinv,
+                          size_t n,
+                          uint64_t *t)
+{
+    memset(t, 0, sizeof(uint64_t) * (n + 2));
+    for (size_t i = 0; i < n; i++) {
+        uint64_t carry = 0;
+        for (size_t j = 0; j < n; j++) {
+            uint128_t tmp = (uint128_t) a[j] * b[i] + t[j] + carry;
+            t[j] = tmp;
+            carry = tmp >> 64;
+        }
+        uint128_t top = (uint128_t) t[n] + carry;
+        t[n] = top;
+        t[n + 1] = top >> 64;
+        uint64_t m = t[0] * qinv;
+        carry = ((uint128_t) m * q[0] + t[0]) >> 64;
+        for (size_t j = 1; j < n; j++) {
+            uint128_t tmp = (uint128_t) m * q[j] + t[j] + carry;
+            t[j - 1] = tmp;
+            carry = tmp >> 64;
+        }
+        top = (uint128_t) t[n] + carry;
+        t[n - 1] = top;
+        t[n] = t[n + 1] + (uint64_t)(top >> 64);
+    }
+    // t < 2q
+    if (t[n] || limb_cmp(t, q, n) >= 0)
+        limb_sub(t, t, n, q, n);
+    memcpy(r, t, sizeof(uint64_t) * n);
+}
+
+/**
+ * fib_mod_pow2: fib(k) mod 2^(64n) by fast doubling on truncated products
+ * Carries and borrows out of the top limb are simply dropped, residues of
+ * up to 2 limbs are kept in 128-bit integers
+ * @ws: working memory of 5n limbs
+ */
+static void fib_mod_pow2(uint64_t k, size_t n, uint64_t *res, uint64_t *ws)
+{
+    if (n <= 2) {
+        uint128_t a = 0, b = 1;
+        for (uint64_t bit = k ? 1ULL << (63 - __builtin_clzll(k)) : 0; bit;
+             bit >>= 1) {
+            uint128_t c = a * (2 * b - a), d = a * a + b * b;
+            a = k & bit ? d : c;
+            b = k & bit ? c + d : d;
+        }
+        res[0] = a;
+        if (n == 2)
+            res[1] = a >> 64;
+        return;
+    }
+    uint64_t *a = ws, *b = ws + n, *c = ws + 2 * n, *d = ws + 3 * n,
+             *e = ws + 4 * n;
+    memset(ws, 0, sizeof(uint64_t) * 2 * n);
+    b[0] = 1;
+    for (uint64_t bit = k ? 1ULL << (63 - __builtin_clzll(k)) : 0; bit;
+         bit >>= 1) {
+        // c = fib(2n) = a * (2b - a), d = fib(2n+1) = a^2 + b^2
+        limb_add(e, b, n, b, n);
+        limb_sub(e, e, n, a, n);
+        limb_mullo(c, a, e, n);
+        limb_mullo(d, a, a, n);
+        limb_mullo(e, b, b, n);
+        limb_add(d, d, n, e, n);
+        if (k & bit) {
+            memcpy(a, d, sizeof(uint64_t) * n);
+            limb_add(b, c, n, d, n);
+        } else {
+            memcpy(a, c, sizeof(uint64_t) * n);
+            memcpy(b, d, sizeof(uint64_t) * n);
+        }
+    }
+    memcpy(res, a, sizeof(uint64_t) * n);
+}
+
+/**
+ * mont_mul_64: montgomery multiplication a * b * 2^-64 mod q for one limb
+ * @qinv: -q^-1 mod 2^64
+ */
+static inline uint64_t mont_mul_64(uint64_t a,
+                                   uint64_t b,
+                                   uint64_t q,
+                                   uint64_t qinv)
+{
+    uint128_t t = (uint128_t) a * b;
+    uint128_t mq = (uint128_t)((uint64_t) t * qinv) * q;
+    // the low limbs cancel, they carry unless both are zero
+    uint128_t r = (t >> 64) + (mq >> 64) + !!(uint64_t) t;
+    return r >= q ? r - q : r;
+}
+
+/**
+ * fib_mod_odd: fib(k) mod q by fast doubling in montgomery form
+ * The doubling formulas are homogeneous of degree 2, so keeping every value
+ * multiplied by R = 2^(64n) only needs fib(1) to start as R mod q
+ * q > 1 is odd with n limbs, the top one not zero
+ * @ws: working memory of 6n + 2 limbs
+ */
+static void fib_mod_odd(uint64_t k,
+                        const uint64_t *q,
+                        size_t n,
+                        uint64_t *res,
+                        uint64_t *ws)
+{
+    uint64_t *a = ws, *b = ws + n, *c = ws + 2 * n, *d = ws + 3 * n,
+             *e = ws + 4 * n, *t = ws + 5 * n;
+    // newton iteration doubles the number of correct bits each time
+    uint64_t qinv = q[0];
+    for (int i = 0; i < 5; i++)
+        qinv *= 2 - q[0] * qinv;
+    qinv = -qinv;
+    if (n == 1) {
+        uint64_t p = q[0], x = 0, y = -p % p;
+        for (uint64_t bit = k ? 1ULL << (63 - __builtin_clzll(k)) : 0; bit;
+             bit >>= 1) {
+            uint64_t z = y >= x ? y - x : y + (p - x);
+            z = z >= p - y ? z - (p - y) : z + y;
+            uint64_t c = mont_mul_64(x, z, p, qinv);
+            uint64_t d = mont_mul_64(x, x, p, qinv);
+            uint64_t e = mont_mul_64(y, y, p, qinv);
+            d = d >= p - e ? d - (p - e) : d + e;
+            x = k & bit ? d : c;
+            y = k & bit ? (c >= p - d ? c - (p - d) : c + d) : d;
+        }
+        res[0] = mont_mul_64(x, 1, p, qinv);
+        return;
+    }
+    memset(ws, 0, sizeof(uint64_t) * 2 * n);
+    // b = R mod q by doubling 1 for 64n times
+    b[0] = 1;
+    for (size_t i = 0; i < 64 * n; i++)
+        limb_add_mod(b, b, b, q, n);
+    for (uint64_t bit = k ? 1ULL << (63 - __builtin_clzll(k)) : 0; bit;
+         bit >>= 1) {
+        limb_add_mod(e, b, b, q, n);
+        limb_sub_mod(e, e, a, q, n);
+        limb_mont_mul(c, a, e, q, qinv, n, t);
+        limb_mont_mul(d, a, a, q, qinv, n, t);
+        limb_mont_mul(e, b, b, q, qinv, n, t);
+        limb_add_mod(d, d, e, q, n);
+        if (k & bit) {
+            memcpy(a, d, sizeof(uint64_t) * n);
+            limb_add_mod(b, c, d, q, n);
+        } else {
+            memcpy(a, c, sizeof(uint64_t) * n);
+            memcpy(b, d, sizeof(uint64_t) * n);
+        }
+    }
+    // multiplying by 1 takes the factor of R out
+    memset(e, 0, sizeof(uint64_t) * n);
+    e[0] = 1;
+    limb_mont_mul(res, a, e, q, qinv, n, t);
+}
+
+int bn_fib_mod(uint64_t k, const uint64_t *m, size_t n, uint64_t *res)
+{
+    if (!n)
+        return -EINVAL;
+    uint64_t *ws = kmalloc_array(16 * n + 4, sizeof(uint64_t), GFP_KERNEL);
+    if (!ws) {
+        printk(KERN_ERR "bn_fib_mod: memory allocation failed\n");
+        return -ENOMEM;
+    }
+    bn_count_alloc();
+    int rc = 0;
+    memset(res, 0, sizeof(uint64_t) * n);
+    if (!m) {
+        fib_mod_pow2(k, n, res, ws);
+        goto out;
+    }
+    size_t mn = n, z = 0;
+    while (mn && !m[mn - 1])
+        mn--;
+    if (!mn) {
+        rc = -EINVAL;
+        goto out;
+    }
+    // m = 2^s * q with q odd
+    while (!m[z])
+        z++;
+    int shift = __builtin_ctzll(m[z]);
+    size_t s = z * 64 + shift, qn = mn - z, sn = (s + 63) / 64;
+    uint64_t *q = ws, *rq = ws + n, *r2 = ws + 2 * n, *inv = ws + 3 * n,
+             *u = ws + 4 * n, *v = ws + 5 * n, *prod = ws + 6 * n,
+             *tmp = ws + 8 * n + 2;
+    memset(ws, 0, sizeof(uint64_t) * (8 * n + 2));
+    for (size_t i = 0; i < qn; i++)
+        q[i] = shift ? m[z + i] >> shift |
+                           (z + i + 1 < mn ? m[z + i + 1] << (64 - shift) : 0)
+                     : m[z + i];
+    while (qn > 1 && !q[qn - 1])
+        qn--;
+    if (qn > 1 || q[0] > 1)
+        fib_mod_odd(k, q, qn, rq, tmp);
+    if (!s) {
+        memcpy(res, rq, sizeof(uint64_t) * qn);
+        goto out;
+    }
+    uint64_t top_mask = s % 64 ? (1ULL << (s % 64)) - 1 : ~0ULL;
+    fib_mod_pow2(k, sn, r2, tmp);
+    r2[sn - 1] &= top_mask;
+    // fib(k) = rq + q * ((r2 - rq) * q^-1 mod 2^s), the chinese remainder
+    // theorem for the coprime factors q and 2^s
+    for (size_t bits = 3; bits < 64 * sn; bits *= 2) {
+        // inv = inv * (2 - q * inv), starting from q^-1 = q mod 8
+        if (bits == 3)
+            memcpy(inv, q, sizeof(uint64_t) * sn);
+        limb_mullo(u, q, inv, sn);
+        memset(v, 0, sizeof(uint64_t) * sn);
+        v[0] = 2;
+        limb_sub(u, v, sn, u, sn);
+        limb_mullo(v, inv, u, sn);
+        memcpy(inv, v, sizeof(uint64_t) * sn);
+    }
+    limb_sub(u, r2, sn, rq, sn);
+    limb_mullo(v, u, inv, sn);
+    v[sn - 1] &= top_mask;
+    limb_mul_basecase(prod, q, qn, v, sn);
+    limb_add(prod, prod, qn + sn, rq, qn);
+    memcpy(res, prod, sizeof(uint64_t) * mn);
+out:
+    kfree(ws);
+    return rc;
+}
+
+/**
+ * lead_norm: round a product down to a float of n limbs
+ * A float is m * 2^e where m has n limbs and its top bit set
+ * @r: receives the n limbs, may overlap p only if p has at most n limbs
+ * @p: the product of len limbs, not zero
+ * @e: exponent of p, receives the exponent of r
+ */
+static void lead_norm(uint64_t *r,
+                      const uint64_t *p,
+                      size_t len,
+                      size_t n,
+                      long long *e)
+{
+    while (!p[len - 1])
+        len--;
+    int shift = __builtin_clzll(p[len - 1]);
+    // the top 64n bits start shift bits below the top of limb len - 1
+    long long drop = (long long) (len - n) * 64 - shift;
+    for (size_t i = 0; i < n; i++) {
+        long long bit = drop + (long long) i * 64;
+        long long limb = bit >> 6;
+        int off = bit & 63;
+        uint64_t lo = limb >= 0 ? p[limb] : 0;
+        uint64_t hi = limb + 1 >= 0 && limb + 1 < (long long) len ? p[limb + 1]
+                                                                  : 0;
+        r[i] = off ? lo >> off | hi << (64 - off) : lo;
+    }
+    *e += drop;
+}
+
+/**
+ * lead_mul: r = a * b for floats of n limbs
+ * The product is truncated, its relative error is below 2^(1 - 64n)
+ * @tmp: 2n limbs of working memory
+ */
+static void lead_mul(uint64_t *r,
+                     long long *er,
+                     const uint64_t *a,
+                     long long ea,
+                     const uint64_t *b,
+                     long long eb,
+                     size_t n,
+                     uint64_t *tmp)
+{
+    if (a == b)
+        limb_sqr_basecase(tmp, a, n);
+    else
+        limb_mul_basecase(tmp, a, n, b, n);
+    *er = ea + eb;
+    lead_norm(r, tmp, 2 * n, n, er);
+}
+
+/**
+ * lead_pow: r = x ^ k for floats of n limbs by squaring from the top bit
+ * Takes at most 2 * 64 truncated products
+ * @tmp: 2n limbs of working memory
+ */
+static void lead_pow(uint64_t *r,
+                     long long *er,
+                     const uint64_t *x,
+                     long long ex,
+                     uint64_t k,
+                     size_t n,
+                     uint64_t *tmp)
+{
+    memset(r, 0, sizeof(uint64_t) * n);
+    r[n - 1] = 1ULL << 63;
+    *er = 1 - 64 * (long long) n;
+    for (uint64_t bit = k ? 1ULL << (63 - __builtin_clzll(k)) : 0; bit;
+         bit >>= 1) {
+        lead_mul(r, er, r, *er, r, *er, n, tmp);
+        if (k & bit)
+            lead_mul(r, er, r, *er, x, ex, n, tmp);
     }
 }
 
-void bn_rshift(struct list_head *head, int bit)
+/**
+ * lead_binet: phi^k / sqrt(5) and 10^-d as floats of n limbs
+ * 1 / sqrt(5) is found by the newton iteration y = y * (3 - 5y^2) / 2,
+ * which needs no division, on fixed point numbers with one limb more than
+ * the floats
+ * @ws: working memory of 8n + 16 limbs
+ */
+static void lead_binet(uint64_t k,
+                       uint64_t d,
+                       size_t n,
+                       uint64_t *f,
+                       long long *ef,
+                       uint64_t *t,
+                       long long *et,
+                       uint64_t *ws)
 {
-    int tmp = bit;
-    for (; tmp > 64; tmp -= 63) {
-        __bn_rshift(head, 63);
+    // fixed point numbers below 4 with g = n + 1 limbs of fraction
+    size_t g = n + 1, w = g + 1;
+    uint64_t *y = ws, *u = ws + w, *v = ws + 2 * w, *p = ws + 3 * w,
+             *tmp = ws + 5 * w;
+    memset(y, 0, sizeof(uint64_t) * w);
+    y[g - 1] = 0x727c9716ffb764d5;
+    for (size_t bits = 64; bits < 64 * g + 64; bits *= 2) {
+        // u = 3 - 5y^2
+        limb_sqr_basecase(p, y, w);
+        memset(u, 0, sizeof(uint64_t) * w);
+        u[g] = 3;
+        for (int i = 0; i < 5; i++)
+            limb_sub(u, u, w, p + g, w);
+        limb_mul_basecase(p, y, w, u, w);
+        memcpy(y, p + g, sizeof(uint64_t) * w);
+        limb_rshift1(y, w);
     }
-    __bn_rshift(head, tmp);
+    // phi = (1 + 5y) / 2
+    memset(u, 0, sizeof(uint64_t) * w);
+    u[g] = 1;
+    for (int i = 0; i < 5; i++)
+        limb_add(u, u, w, y, w);
+    limb_rshift1(u, w);
+    long long ephi = -64 * (long long) g, ey = ephi;
+    lead_norm(v, u, w, n, &ephi);
+    lead_norm(u, y, w, n, &ey);
+    lead_pow(f, ef, v, ephi, k, n, tmp);
+    lead_mul(f, ef, f, *ef, u, ey, n, tmp);
+    // 1/10 = 0.1999...9a in hex
+    for (size_t i = 0; i < g; i++)
+        y[i] = 0x9999999999999999;
+    y[0] = 0x999999999999999a;
+    y[g - 1] = 0x1999999999999999;
+    y[g] = 0;
+    long long etenth = -64 * (long long) g;
+    lead_norm(v, y, w, n, &etenth);
+    lead_pow(t, et, v, etenth, d, n, tmp);
 }
 
-void __bn_rshift(struct list_head *head, int bit)
+/**
+ * lead_floor: floor of m * 2^e for a float of n limbs with n > 2
+ * @return: the integer part, which must be below 2^128
+ */
+static uint128_t lead_floor(const uint64_t *m, size_t n, long long e)
 {
+    long long bits = 64 * (long long) n + e;
+    if (bits <= 0)
+        return 0;
+    // bits of the integer part are the top bits of m, bits <= 128
+    uint128_t top = (uint128_t) m[n - 1] << 64 | m[n - 2];
+    return bits >= 128 ? top : top >> (128 - bits);
+}
+
+int bn_fib_lead(uint64_t k,
+                int base,
+                int digits,
+                uint64_t *lead,
+                uint64_t *exp)
+{
+    if ((base != 2 && base != 10) || digits < 1 ||
+        digits > (base == 2 ? 64 : 19) || k >= LEAD_MAX_K)
+        return -EINVAL;
+    if (k <= (base == 2 ? 186 : 93)) {
+        // numbers of up to 128 bits are calculated exactly, the division of
+        // 128-bit integers is left to those of 64 bits
+        uint128_t a = 0, b = 1;
+        for (uint64_t i = 0; i < k; i++) {
+            uint128_t c = a + b;
+            a = b;
+            b = c;
+        }
+        int len = 1;
+        if (base == 2) {
+            for (uint128_t top = a; top >> 1; top >>= 1)
+                len++;
+            *lead = len > digits ? a >> (len - digits) : a;
+        } else {
+            uint64_t top = a;
+            for (uint64_t v = top; v >= 10; v /= 10)
+                len++;
+            for (int i = len; i > digits; i--)
+                top /= 10;
+            *lead = top;
+        }
+        *exp = len - 1;
+        return 0;
+    }
+    // the number of decimal digits is k log10(phi) - log10(sqrt(5)) + 1
+    // rounded down, or a neighbour of it in rare cases
+    uint64_t nd =
+        (((uint128_t) k * 0x358036c82451b7f3 - 0x5977d95ec10c0219) >> 64) + 1;
+    uint64_t d = base == 10 ? nd - digits : 0;
+    uint128_t low = (uint128_t) 1 << (digits - 1);
+    if (base == 10) {
+        low = 1;
+        for (int i = 1; i < digits; i++)
+            low *= 10;
+    }
+    for (size_t n = 3; n <= LEAD_MAX_LIMBS; n *= 2) {
+        uint64_t *ws = kmalloc_array(13 * n + 16, sizeof(uint64_t), GFP_KERNEL);
+        if (!ws) {
+            printk(KERN_ERR "bn_fib_lead: memory allocation failed\n");
+            return -ENOMEM;
+        }
+        bn_count_alloc();
+        uint64_t *f = ws + 8 * n + 16, *t = f + n, *lo = t + n, *hi = lo + n,
+                 *err = hi + n;
+        for (int tries = 0; tries < 4; tries++) {
+            long long ef, et, eint;
+            lead_binet(k, d, n, f, &ef, t, &et, ws);
+            if (base == 10) {
+                lead_mul(f, &ef, f, ef, t, et, n, ws);
+                eint = ef;
+            } else {
+                eint = digits - 64 * (long long) n;
+            }
+            uint128_t val = lead_floor(f, n, eint);
+            if (val < low) {
+                d--;
+                continue;
+            }
+            if (base == 10 ? val >= low * 10 : val >> digits) {
+                d++;
+                continue;
+            }
+            // every truncation loses less than 2^(1 - 64n) of the value, but
+            // one made on x^j in lead_pow is raised to the power k / j, so
+            // the truncations of phi and 1/10 grow by k and d and those of
+            // the products by at most 4k and 4d, which is 12(k + d) + 8 ulps
+            // of f at most. The bound of 16(k + d) + 1024 ulps leaves room
+            // for the second order terms and the error of the newton
+            // iteration, tightening it gains nothing since the digits are
+            // decided far above it. binet without (1 - phi)^k / sqrt(5) is
+            // off by less than phi^-2k < 2^(-1.388k)
+            uint128_t bound = 16 * ((uint128_t) k + d) + 1024;
+            uint64_t ulp[2] = {bound, bound >> 64};
+            long long sh =
+                k < 1000 ? 64 * (long long) n - 1388 * (long long) k / 1000
+                         : -1;
+            memset(err, 0, sizeof(uint64_t) * n);
+            if (sh >= 0)
+                err[sh / 64] = 1ULL << (sh % 64);
+            limb_add(err, err, n, ulp, 2);
+            limb_sub(lo, f, n, err, n);
+            int carry = limb_add(hi, f, n, err, n);
+            // the digits are known once both ends of the error agree
+            if (!carry && lead_floor(lo, n, eint) == lead_floor(hi, n, eint)) {
+                *lead = val;
+                *exp = base == 10 ? d + digits - 1 : ef + 64 * n - 1;
+                kfree(ws);
+                return 0;
+            }
+            break;
+        }
+        kfree(ws);
+    }
+    return -ERANGE;
+}
+
+int bn_lshift(bn *num, int bit)
+{
+    size_t limbs = bit / val_size;
+    if (limbs && (num->size > 1 || num->digits[0])) {
+        size_t size = num->size;
+        if (unlikely(bn_resize(num, size + limbs)))
+            return -ENOMEM;
+        memmove(num->digits + limbs, num->digits, sizeof(uint64_t) * size);
+        memset(num->digits, 0, sizeof(uint64_t) * limbs);
+    }
+    return __bn_lshift(num, bit % val_size);
+}
+
+int __bn_lshift(bn *num, int bit)
+{
+    if (!bit)
+        return 0;
     uint64_t carry = 0;
-    bn_node *node;
-    list_for_each_entry_reverse(node, head, list)
-    {
-        uint64_t tmp = node->val;
-        node->val >>= bit;
-        node->val |= carry;
-        carry = tmp << (64 - bit);
+    for (size_t i = 0; i < num->size; i++) {
+        uint64_t tmp = num->digits[i];
+        num->digits[i] = tmp << bit | carry;
+        carry = tmp >> (val_size - bit);
     }
-    if (bn_last_val(head) == 0) {
-        bn_pop(head);
+    if (carry) {
+        if (unlikely(bn_resize(num, num->size + 1)))
+            return -ENOMEM;
+        num->digits[num->size - 1] = carry;
     }
+    return 0;
 }
 
-uint64_t *bn_to_array(struct list_head *head)
+void bn_rshift(bn *num, int bit)
 {
-    bn_clean(head);
-    uint64_t *res = kmalloc(sizeof(uint64_t) * bn_size(head), GFP_KERNEL);
-    int i = 0;
-    bn_node *node;
-    list_for_each_entry (node, head, list) {
-        res[i++] = node->val;
+    size_t limbs = bit / val_size;
+    if (limbs >= num->size) {
+        bn_set(num, 0);
+        return;
+    }
+    if (limbs) {
+        num->size -= limbs;
+        memmove(num->digits, num->digits + limbs,
+                sizeof(uint64_t) * num->size);
+    }
+    __bn_rshift(num, bit % val_size);
+}
+
+void __bn_rshift(bn *num, int bit)
+{
+    if (!bit)
+        return;
+    uint64_t carry = 0;
+    for (size_t i = num->size; i-- > 0;) {
+        uint64_t tmp = num->digits[i];
+        num->digits[i] = tmp >> bit | carry;
+        carry = tmp << (val_size - bit);
     }
+    bn_clean(num);
+}
+
+uint64_t *bn_to_array(bn *num)
+{
+    bn_clean(num);
+    size_t bytes = sizeof(uint64_t) * bn_size(num);
+    uint64_t *res =
+        bytes >= PAGE_SIZE ? vmalloc_user(bytes) : kmalloc(bytes, GFP_KERNEL);
+    if (!res)
+        return NULL;
+    bn_count_alloc();
+    memcpy(res, num->digits, sizeof(uint64_t) * bn_size(num));
     return res;
 }
 
-uint64_t *bn_split(struct list_head *head, size_t size)
+uint64_t *bn_split(bn *num, size_t size)
 {
-    if (!head) {
+    if (!num) {
         printk(KERN_ERR "bn_split: invalid input\n");
         return NULL;
     }
-    bn_clean(head);
-    printk(KERN_INFO "bn_split: size = %ld\n", size);
+    bn_clean(num);
     uint64_t *res = kmalloc(sizeof(uint64_t) * size, GFP_KERNEL);
     if (!res) {
         printk(KERN_ERR "bn_split: memory allocation failed\n");
         return NULL;
     }
+    bn_count_alloc();
     memset((char *) res, 0, sizeof(uint64_t) * size);
-    int i = 0;
-    bn_node *node;
-    list_for_each_entry (node, head, list) {
-        for (int j = 0; j < val_size; j += chunck_size) {
-            if (i < size)
-                res[i++] |= (node->val >> j) & chunk_mask;
-        }
+    size_t i = 0;
+    for (size_t k = 0; k < num->size; k++) {
+        uint64_t val = num->digits[k];
+        for (int j = 0; j < val_size && i < size; j += chunck_size)
+            res[i++] = (val >> j) & chunk_mask;
     }
-    printk(KERN_INFO "bn_split: i = %d\n", i);
     return res;
 }
 
-int bn_cmp(struct list_head *a, struct list_head *b)
+int bn_cmp(const bn *a, const bn *b)
 {
     if (bn_size(a) < bn_size(b)) {
         return -1;
     } else if (bn_size(a) > bn_size(b)) {
         return 1;
     }
-    // equal in size, compare each node from the end
-    else {
-        bn_node *node_a;
-        struct list_head *b_cur = b->prev;
-        list_for_each_entry_reverse(node_a, a, list)
-        {
-            bn_node *node_b = list_entry(b_cur, bn_node, list);
-            if (node_a->val < node_b->val) {
-                return -1;
-            } else if (node_a->val > node_b->val) {
-                return 1;
-            } else {
-                b_cur = b_cur->prev;
-            }
+    // equal in size, compare each limb from the end
+    for (size_t i = bn_size(a); i-- > 0;) {
+        if (a->digits[i] < b->digits[i]) {
+            return -1;
+        } else if (a->digits[i] > b->digits[i]) {
+            return 1;
         }
     }
     return 0;
-}
\ No newline at end of file
+}
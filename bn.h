@@ -1,7 +1,11 @@
 #ifndef __BIGNUM_H_
 #define __BIGNUM_H_
 
+#include <linux/atomic.h>
+#include <linux/errno.h>
+#include <linux/percpu.h>
 #include <linux/slab.h>
+#include <linux/string.h>
 
 // Use division to replace floating number calculation
 // DIVISOR = 10^6 to prevent multiplication overflow
@@ -14,187 +18,230 @@
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
-#define BN_INIT(name, size) struct list_head *name = bn_new(size)
-#define BN_INIT_VAL(name, size, val)       \
-    struct list_head *name = bn_new(size); \
-    bn_set(name, val)
-#define bn_size(head) (list_entry(head, bn_head, list)->size)
-#define bn_node_val(node) (list_entry(node, bn_node, list)->val)
-#define bn_first_val(head) (list_first_entry(head, bn_node, list)->val)
-#define bn_last_val(head) (list_last_entry(head, bn_node, list)->val)
-#define bn_pop(head)                                          \
-    do {                                                      \
-        bn_node *node = list_last_entry(head, bn_node, list); \
-        list_del(&node->list);                                \
-        kfree(node);                                          \
-        bn_size(head)--;                                      \
+#define BN_INIT(name, size) bn *name = bn_new(size)
+#define BN_INIT_VAL(name, size, val) \
+    bn *name = bn_new(size);         \
+    if (name)                        \
+        bn_set(name, val)
+#define bn_size(num) ((num)->size)
+#define bn_first_val(num) ((num)->digits[0])
+#define bn_last_val(num) ((num)->digits[(num)->size - 1])
+#define bn_pop(num)          \
+    do {                     \
+        if ((num)->size > 1) \
+            (num)->size--;   \
     } while (0)
 
+// build with BN_DEBUG=y to count the allocations made by the bignum routines
+#ifdef BN_DEBUG
+extern atomic_long_t bn_alloc_count;
+#define bn_count_alloc() atomic_long_inc(&bn_alloc_count)
+#define bn_alloc_read() atomic_long_read(&bn_alloc_count)
+#else
+#define bn_count_alloc() \
+    do {                 \
+    } while (0)
+#define bn_alloc_read() 0L
+#endif
+
 
 
 /**
- * bn_head - store the head of bn list
- * @size: size of the list
- * @sign: sign of the bn
- * @list: list_head of the list
+ * bn - an unsigned big number stored in a contiguous array of limbs
+ * The limbs are stored from the least significant one, the most significant
+ * limb is non-zero unless the value is zero, in which case size is 1
+ * @digits: array of limbs
+ * @size: number of limbs in use
+ * @capacity: number of limbs allocated
  */
 typedef struct {
+    uint64_t *digits;
     size_t size;
-    struct list_head list;
-} bn_head;
+    size_t capacity;
+} bn;
+
+// slab cache of the bn headers, see bn_init
+extern struct kmem_cache *bn_cachep;
 
 /**
- * bn_node - store a node of bn list
- * The value should be within 10^19
- * @val: value of the node
- * @list: list_head of the node
+ * bn_alloc: allocate a bn with room for capacity limbs
+ * The value of the returned bn is zero
+ * @capacity: number of limbs to be allocated
+ * @return: the allocated bn, NULL if failed to allocate memory
  */
-typedef struct {
-    uint64_t val;
-    struct list_head list;
-} bn_node;
+static inline bn *bn_alloc(size_t capacity)
+{
+    bn *num = kmem_cache_alloc(bn_cachep, GFP_KERNEL);
+    if (!num)
+        return NULL;
+    bn_count_alloc();
+    capacity = capacity ? capacity : 1;
+    num->digits = kmalloc(sizeof(uint64_t) * capacity, GFP_KERNEL);
+    if (!num->digits) {
+        kmem_cache_free(bn_cachep, num);
+        return NULL;
+    }
+    num->digits[0] = 0;
+    num->size = 1;
+    num->capacity = capacity;
+    return num;
+}
 
 /**
- * bn_alloc: allocate memory for a bn list
- * Exit if failed to allocate memory
- * @return: the list_head of the list
+ * bn_reserve: make sure a bn has room for at least capacity limbs
+ * The buffer grows geometrically so that repeated growth is amortized
+ * @num: bn to be expanded
+ * @capacity: number of limbs required
+ * @return: 0 on success, -ENOMEM if failed to allocate memory
  */
-static inline struct list_head *bn_alloc(void)
+static inline int bn_reserve(bn *num, size_t capacity)
 {
-    bn_head *bn_list = kmalloc(sizeof(bn_head), GFP_KERNEL);
-    bn_list->size = 0;
-    INIT_LIST_HEAD(&bn_list->list);
-    return &bn_list->list;
+    if (likely(capacity <= num->capacity))
+        return 0;
+    size_t new_cap = num->capacity << 1;
+    if (new_cap < capacity)
+        new_cap = capacity;
+    uint64_t *digits =
+        krealloc(num->digits, sizeof(uint64_t) * new_cap, GFP_KERNEL);
+    if (!digits) {
+        printk(KERN_ERR "bn_reserve: memory allocation failed\n");
+        return -ENOMEM;
+    }
+    bn_count_alloc();
+    num->digits = digits;
+    num->capacity = new_cap;
+    return 0;
 }
 
 /**
- * bn_newnode: create a new node and add it to the tail of the list
- * @val: value of the node
- * @head: head of the list
+ * bn_resize: change the number of limbs in use
+ * Newly used limbs are filled with zeros
+ * @num: bn to be resized
+ * @size: new number of limbs
+ * @return: 0 on success, -ENOMEM if failed to allocate memory
  */
-static inline void bn_newnode(struct list_head *head, uint64_t val)
+static inline int bn_resize(bn *num, size_t size)
 {
-    bn_node *node = kmalloc(sizeof(bn_node), GFP_KERNEL);
-    node->val = val;
-    INIT_LIST_HEAD(&node->list);
-    list_add_tail(&node->list, head);
-    bn_size(head)++;
+    if (unlikely(bn_reserve(num, size)))
+        return -ENOMEM;
+    if (size > num->size)
+        memset(num->digits + num->size, 0,
+               sizeof(uint64_t) * (size - num->size));
+    num->size = size;
+    return 0;
 }
 
 /**
- * bn_free: free a bn list
- * @head: head of the bn list to be freed
+ * bn_free: free a bn
+ * @num: bn to be freed
  */
-static inline void bn_free(struct list_head *head)
+static inline void bn_free(bn *num)
 {
-    if (!head)
+    if (!num)
         return;
-    bn_node *node, *tmp;
-    list_for_each_entry_safe (node, tmp, head, list) {
-        list_del(&node->list);
-        kfree(node);
-    }
-    kfree(list_entry(head, bn_head, list));
+    kfree(num->digits);
+    kmem_cache_free(bn_cachep, num);
 }
 
 /**
- * bn_new: create a new bn to store fib(n)
+ * bn_fib_limbs: estimate the number of limbs of fib(n)
  * Uses logrithmic of the Binets formula to calculate number of digits
- * Allocate the nodes of the list according to the number of digits
  * fib(n) = (phi^n - (1 - phi)^n) / sqrt(5)
  * digits = log10(fib(n)) = n * log10(phi) - log10(sqrt(5))
- * The return bn have zeros in each node value
+ * The rounded constants may underestimate by a few bits for large n
  * @n: offset of fib
- * @return: head of bn list
+ * @return: number of limbs
  */
-static inline struct list_head *bn_new(size_t n)
+static inline size_t bn_fib_limbs(size_t n)
 {
-    unsigned int list_len =
-        n > 1 ? (n * LOG2PHI - LOG2SQRT5) / DIVISOR / 64 + 1 : 1;
-    struct list_head *head = bn_alloc();
-    for (; list_len; list_len--) {
-        bn_newnode(head, 0);
-    }
-    return head;
+    return n > 1 ? (n * LOG2PHI - LOG2SQRT5) / DIVISOR / 64 + 1 : 1;
 }
 
 /**
- * bn_set: set the value of a bn list
+ * bn_new: create a new bn to store fib(n)
+ * Allocate the limbs of the bn according to bn_fib_limbs
+ * The return bn is zero
+ * @n: offset of fib
+ * @return: the new bn, NULL if failed to allocate memory
+ */
+static inline bn *bn_new(size_t n)
+{
+    return bn_alloc(bn_fib_limbs(n));
+}
+
+/**
+ * bn_scratch - working memory of the multiplications
+ * Allocated once so that a sequence of products does not need to call the
+ * allocator, see bn_scratch_new
+ * @tmp: scratch limbs of schoolbook, karatsuba and toom-cook 3-way
+ * @tmp_size: number of limbs in tmp
+ * @crt: coefficients of the transforms over the three primes
+ * @crt_size: number of coefficients in crt
+ */
+typedef struct {
+    uint64_t *tmp;
+    size_t tmp_size;
+    uint64_t *crt;
+    size_t crt_size;
+} bn_scratch;
+
+/**
+ * bn_scratch_bytes: size of a working memory
+ * @s: scratch to be measured, may be NULL
+ * @return: number of bytes held by the arrays of s
+ */
+static inline size_t bn_scratch_bytes(const bn_scratch *s)
+{
+    return s ? sizeof(uint64_t) * (s->tmp_size + s->crt_size) : 0;
+}
+
+/**
+ * bn_set: set the value of a bn
  * The set value should be within UINT64_MAX
- * If the set value has more digits than the list, expand the list
- * @head: head of the bn list
+ * @num: bn to be set
  * @val: value to be set
  */
-static inline void bn_set(struct list_head *head, uint64_t val)
+static inline void bn_set(bn *num, uint64_t val)
 {
-    bn_first_val(head) = val;
+    num->digits[0] = val;
+    num->size = 1;
 }
 
 /**
- * bn_copy: copy a bn list to another
- * @dest: destination bn list to be copied to
- * @target: target bn list to be copied from
+ * bn_clean: remove the leading zeros of a bn
+ * @num: bn to be cleaned
  */
-static inline void bn_copy(struct list_head *dest, struct list_head *target)
+static inline void bn_clean(bn *num)
 {
-    if (list_is_singular(target)) {
-        bn_first_val(dest) = bn_first_val(target);
-        return;
-    }
-    bn_node *node;
-    struct list_head *cur = dest->next;
-    uint8_t size = 0;
-    list_for_each_entry (node, target, list) {
-        if (!node->val && ++size < bn_size(target))
-            continue;
-        if (cur != dest) {
-            bn_node_val(cur) = node->val;
-            cur = cur->next;
-        } else {
-            bn_newnode(dest, node->val);
-        }
-        size++;
-    }
-    while (cur != dest) {
-        struct list_head *tmp = cur->next;
-        list_del(cur);
-        kfree(list_entry(cur, bn_node, list));
-        bn_size(dest)--;
-        cur = tmp;
-    }
+    while (num->size > 1 && !num->digits[num->size - 1])
+        num->size--;
 }
 
 /**
- * bn_clean: remove the leading zeros of a bn list
- * @head: head of the bn list
+ * bn_copy: copy a bn to another
+ * @dest: destination bn to be copied to
+ * @target: target bn to be copied from
+ * @return: 0 on success, -ENOMEM if failed to allocate memory
  */
-static inline void bn_clean(struct list_head *head)
+static inline int bn_copy(bn *dest, const bn *target)
 {
-    if (list_empty(head) || list_is_singular(head))
-        return;
-    bn_node *node, *tmp;
-    list_for_each_entry_safe_reverse(node, tmp, head, list)
-    {
-        if (node->val || list_is_singular(head))
-            break;
-        list_del(&node->list);
-        kfree(node);
-        bn_size(head)--;
-    }
+    if (unlikely(bn_reserve(dest, target->size)))
+        return -ENOMEM;
+    memcpy(dest->digits, target->digits, sizeof(uint64_t) * target->size);
+    dest->size = target->size;
+    bn_clean(dest);
+    return 0;
 }
 
 /**
- * bn_print: print a bn list
+ * bn_print: print a bn
  * For debugging purpose
- * @head: head of the bn list
+ * @num: bn to be printed
  */
-static inline void bn_print(struct list_head *head)
+static inline void bn_print(const bn *num)
 {
-    bn_node *node;
-    list_for_each_entry_reverse(node, head, list)
-    {
-        printk(KERN_INFO "/%llu", node->val);
-    }
+    for (size_t i = num->size; i-- > 0;)
+        printk(KERN_INFO "/%llu", num->digits[i]);
     printk(KERN_INFO "\n");
 }
 
@@ -203,116 +250,350 @@ static inline void bn_print(struct list_head *head)
  *
  * @a: first bn
  * @b: second bn
+ * @return: 0 on success, -ENOMEM if failed to allocate memory
  */
-void bn_add(struct list_head *a, struct list_head *b);
+int bn_add(bn *a, const bn *b);
 
 /**
  * bn_add_to_smaller: add two bns a, b to the smaller one
  * @a: first bn
  * @b: second bn
+ * @return: 0 on success, -ENOMEM if failed to allocate memory
  */
-void bn_add_to_smaller(struct list_head *a, struct list_head *b);
+int bn_add_to_smaller(bn *a, bn *b);
 
 /**
  * __bn_add: add two bns to the first one
  * the result is expected to be positive
  * @shorter: first bn
  * @longer: second bn
+ * @return: 0 on success, -ENOMEM if failed to allocate memory
  */
-void __bn_add(struct list_head *shorter, struct list_head *longer);
+int __bn_add(bn *shorter, const bn *longer);
 
 /**
- * bn_sub: subtract two bns and store result to c
+ * bn_sub: subtract two bns and store result to the larger one
  * the result is expected to be positive
- * c = a - b , a > b
- * c = b - a , a < b
+ * a = a - b , a >= b
+ * b = b - a , a < b
  * @a: first bn
  * @b: second bn
-
  */
-void bn_sub(struct list_head *a, struct list_head *b);
+void bn_sub(bn *a, bn *b);
 
-void __bn_sub(struct list_head *a, struct list_head *b);
+/**
+ * __bn_sub: subtract less from more and store result to more
+ * @more: the larger bn
+ * @less: the smaller bn
+ */
+void __bn_sub(bn *more, const bn *less);
 
 /**
  * bn_mul: multiply two bns and store result to c
  * c = a * b
+ * c should not be the same bn as a or b
+ * @a: first bn
+ * @b: second bn
+ * @c: result bn
+ * @return: 0 on success, -ENOMEM if failed to allocate memory
+ */
+int bn_mul(const bn *a, const bn *b, bn *c);
+
+/**
+ * bn_sqr: square a bn and store result to c
+ * Computes every cross product once and doubles the sum, which takes
+ * about half the work of bn_mul
+ * c = a ^ 2
+ * c should not be the same bn as a
+ * @a: base bn
+ * @c: result bn
+ * @return: 0 on success, -ENOMEM if failed to allocate memory
+ */
+int bn_sqr(const bn *a, bn *c);
+
+/**
+ * bn_karatsuba: multiply two bns and store result to c
+ * using karatsuba algorithm
+ * c = a * b
+ * c should not be the same bn as a or b
  * @a: first bn
  * @b: second bn
  * @c: result bn
+ * @return: 0 on success, -ENOMEM if failed to allocate memory
  */
-void bn_mul(struct list_head *a, struct list_head *b, struct list_head *c);
+int bn_karatsuba(const bn *a, const bn *b, bn *c);
+
+/**
+ * bn_sqr_karatsuba: square a bn and store result to c
+ * using karatsuba algorithm
+ * c = a ^ 2
+ * @a: base bn
+ * @c: result bn
+ * @return: 0 on success, -ENOMEM if failed to allocate memory
+ */
+int bn_sqr_karatsuba(const bn *a, bn *c);
+
+/**
+ * bn_toom3: multiply two bns and store result to c
+ * using toom-cook 3-way algorithm
+ * c = a * b
+ * c should not be the same bn as a or b
+ * @a: first bn
+ * @b: second bn
+ * @c: result bn
+ * @return: 0 on success, -ENOMEM if failed to allocate memory
+ */
+int bn_toom3(const bn *a, const bn *b, bn *c);
+
+/**
+ * bn_sqr_toom3: square a bn and store result to c
+ * using toom-cook 3-way algorithm
+ * c = a ^ 2
+ * @a: base bn
+ * @c: result bn
+ * @return: 0 on success, -ENOMEM if failed to allocate memory
+ */
+int bn_sqr_toom3(const bn *a, bn *c);
+
+/**
+ * bn_scratch_new: allocate working memory for bn_fast_mul and bn_fast_sqr
+ * @n: number of limbs of the longest operand to be multiplied
+ * @return: the new scratch, NULL if failed to allocate memory
+ */
+bn_scratch *bn_scratch_new(size_t n);
+
+/**
+ * bn_scratch_new_doubling: allocate working memory for bn_doubling_strassen
+ * @n: number of limbs of the longest operand
+ * @return: the new scratch, NULL if failed to allocate memory
+ */
+bn_scratch *bn_scratch_new_doubling(size_t n);
+
+/**
+ * bn_scratch_free: free working memory allocated by bn_scratch_new
+ * @s: scratch to be freed
+ */
+void bn_scratch_free(bn_scratch *s);
+
+/**
+ * bn_fast_mul: multiply two bns and store result to c
+ * Picks schoolbook, karatsuba, toom-cook 3-way or ntt by the number of limbs
+ * c = a * b
+ * c should not be the same bn as a or b
+ * @a: first bn
+ * @b: second bn
+ * @c: result bn
+ * @s: working memory, allocated on demand if NULL or too small
+ * @return: 0 on success, -ENOMEM if failed to allocate memory
+ */
+int bn_fast_mul(bn *a, bn *b, bn *c, bn_scratch *s);
+
+/**
+ * bn_fast_sqr: square a bn and store result to c
+ * Picks schoolbook, karatsuba, toom-cook 3-way or ntt by the number of limbs
+ * c = a ^ 2
+ * @a: base bn
+ * @c: result bn
+ * @s: working memory, allocated on demand if NULL or too small
+ * @return: 0 on success, -ENOMEM if failed to allocate memory
+ */
+int bn_fast_sqr(bn *a, bn *c, bn_scratch *s);
 
 /**
  * bn_strassen: multiply two bns and store result to c
  * using schonhage-strassen algorithm
+ * The transform over a single prime holds the product of operands of about
+ * 2128 limbs, larger ones are left to bn_fast_mul
  * c = a * b
  * @a: first bn
  * @b: second bn
  * @c: result bn
+ * @return: 0 on success, -EINVAL if a bn is NULL, -ENOMEM if failed to
+ * allocate memory
  */
-void bn_strassen(struct list_head *a, struct list_head *b, struct list_head *c);
+int bn_strassen(bn *a, bn *b, bn *c);
 
 /**
  * bn_sqr_strassen: square a bn and store result to c
  * using schonhage-strassen algorithm
+ * Operands of more than about 2128 limbs are left to bn_fast_sqr
  * c = a ^ 2
  * @a: base bn
  * @c: result bn
+ * @return: 0 on success, -EINVAL if a bn is NULL, -ENOMEM if failed to
+ * allocate memory
  */
-void bn_sqr_strassen(struct list_head *a, struct list_head *c);
+int bn_sqr_strassen(bn *a, bn *c);
+
+/**
+ * bn_strassen_crt: multiply two bns and store result to c
+ * using schonhage-strassen algorithm over three primes, which lets every
+ * coefficient carry 32 bits instead of 8
+ * c = a * b
+ * @a: first bn
+ * @b: second bn
+ * @c: result bn
+ * @return: 0 on success, -EINVAL if a bn is NULL, -ENOMEM if failed to
+ * allocate memory
+ */
+int bn_strassen_crt(bn *a, bn *b, bn *c);
+
+/**
+ * bn_sqr_strassen_crt: square a bn and store result to c
+ * using schonhage-strassen algorithm over three primes
+ * c = a ^ 2
+ * @a: base bn
+ * @c: result bn
+ * @return: 0 on success, -EINVAL if a bn is NULL, -ENOMEM if failed to
+ * allocate memory
+ */
+int bn_sqr_strassen_crt(bn *a, bn *c);
+
+/**
+ * bn_doubling_strassen: both products of a fast doubling step
+ * Transforms a and b once per prime and forms both results from the same
+ * transforms, with a = fib(n) and b = fib(n+1) this gives fib(2n+1) and
+ * fib(2n+2)
+ * c = a ^ 2 + b ^ 2
+ * d = b * (2 * a + b)
+ * c and d should not be the same bn as a or b
+ * @a: first bn
+ * @b: second bn
+ * @c: first result bn
+ * @d: second result bn
+ * @s: working memory, allocated on demand if NULL or too small
+ * @return: 0 on success, -EINVAL if a bn is NULL, -ENOMEM if failed to
+ * allocate memory
+ */
+int bn_doubling_strassen(bn *a, bn *b, bn *c, bn *d, bn_scratch *s);
+
+/**
+ * bn_fib_mod: calculate fib(k) mod m with fast doubling on residues
+ * Only residues of n limbs are kept, so neither time nor memory grows with
+ * the size of fib(k). m = 2^s * q is split into a power of 2, kept by
+ * dropping the high limbs of the products, and an odd q, kept by montgomery
+ * multiplication, and the two residues are joined by the chinese remainder
+ * theorem
+ * @k: index of the fibonacci number
+ * @m: modulus of n limbs, least significant first, NULL for 2^(64 * n)
+ * @n: number of limbs of m and res
+ * @res: n limbs receiving fib(k) mod m
+ * @return: 0 on success, -EINVAL if m is zero, -ENOMEM if failed to allocate
+ * memory
+ */
+int bn_fib_mod(uint64_t k, const uint64_t *m, size_t n, uint64_t *res);
+
+/**
+ * bn_fib_lead: leading digits of fib(k) from the formula of binet
+ * fib(k) is close to phi^k / sqrt(5), which is evaluated on floating point
+ * numbers of a few limbs, so neither time nor memory grows with the size of
+ * fib(k). The error of every product is tracked, and the precision is
+ * raised until the digits are the same at both ends of the error.
+ * @k: index of the fibonacci number, below 2^62
+ * @base: 2 or 10
+ * @digits: number of leading digits, at most 64 for base 2 and 19 for base
+ * 10
+ * @lead: receives the leading digits, all of them if fib(k) has fewer
+ * @exp: receives the number of digits of fib(k) minus one
+ * @return: 0 on success, -EINVAL for invalid arguments, -ENOMEM if failed to
+ * allocate memory, -ERANGE if the digits could not be told apart, which
+ * happens when they are followed by a very long run of zeros or nines
+ */
+int bn_fib_lead(uint64_t k,
+                int base,
+                int digits,
+                uint64_t *lead,
+                uint64_t *exp);
 
 /**
  * bn_lshift: left shift a bn by bit
- * @head: bn to be shifted
+ * @num: bn to be shifted
  * @bit: number of bits to be shifted
+ * @return: 0 on success, -ENOMEM if failed to allocate memory
  */
-void bn_lshift(struct list_head *head, int bit);
+int bn_lshift(bn *num, int bit);
 
 /**
  * __bn_lshift: left shift a bn by bit
  * Number of bits to be shifted is expected to be smaller than 64
- * @head: bn to be shifted
+ * @num: bn to be shifted
  * @bit: number of bits to be shifted
+ * @return: 0 on success, -ENOMEM if failed to allocate memory
  */
-void __bn_lshift(struct list_head *head, int bit);
+int __bn_lshift(bn *num, int bit);
 
 /**
  * bn_rshift: right shift a bn by bit
- * @head: bn to be shifted
+ * @num: bn to be shifted
  * @bit: number of bits to be shifted
  */
-void bn_rshift(struct list_head *head, int bit);
+void bn_rshift(bn *num, int bit);
 
 /**
  * __bn_rshift: right shift a bn by  bit
  * Number of bits to be shifted is expected to be smaller than 64,
- * @head: bn to be shifted
+ * @num: bn to be shifted
  * @bit: number of bits to be shifted
  */
-void __bn_rshift(struct list_head *head, int bit);
+void __bn_rshift(bn *num, int bit);
 
 /**
  * bn_to_array: convert a bn to an array
- * the array has the same order with bn_list
- * @head: bn to be converted
+ * the array has the same order with the limbs of bn
+ * An array of a page or more is page backed by vmalloc_user so that it can
+ * be mapped to user space, the array should be freed by kvfree
+ * @num: bn to be converted
  * @return: array of uint64_t
  */
-uint64_t *bn_to_array(struct list_head *head);
+uint64_t *bn_to_array(bn *num);
 
 /**
  * bn_split : split a bn into chuncks of 8 bits
- * @head: bn to be converted
+ * @num: bn to be converted
  * @return: array of uint64_t
  */
-uint64_t *bn_split(struct list_head *head, size_t size);
+uint64_t *bn_split(bn *num, size_t size);
 
 /**
- * bn_compare: compare two bn lists
+ * bn_compare: compare two bns
  * @a: first bn
  * @b: second bn
  * @return: 1 if a > b, 0 if a == b, -1 if a < b
  */
-int bn_cmp(struct list_head *a, struct list_head *b);
+int bn_cmp(const bn *a, const bn *b);
+
+// limb operations of the long loops between two preemption points
+#define BN_RESCHED_WORK (1UL << 16)
+
+DECLARE_PER_CPU(unsigned long, bn_work);
+
+/**
+ * __bn_resched: preemption point of the long loops, see bn_resched
+ * Measures the stretch that ends here if stretch_measure is set
+ */
+void __bn_resched(void);
+
+/**
+ * bn_resched: account the work of a long loop and offer to reschedule
+ * once BN_RESCHED_WORK limb operations have been done on this cpu, which
+ * bounds the time a calculation holds a cpu on a non-preemptible kernel
+ * @work: limb operations done since the last call
+ */
+static inline void bn_resched(unsigned long work)
+{
+    if (this_cpu_add_return(bn_work, work) >= BN_RESCHED_WORK)
+        __bn_resched();
+}
+
+/**
+ * bn_init: create the slab cache of the bn headers
+ * @return: 0 on success, -ENOMEM if failed to allocate memory
+ */
+int bn_init(void);
+
+/**
+ * bn_exit: destroy the slab cache of the bn headers
+ */
+void bn_exit(void);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,197 @@
+#include <linux/hashtable.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/version.h>
+#include "cache.h"
+
+#define FIB_CACHE_BITS 8
+
+static unsigned long cache_budget = 16 << 20;
+module_param(cache_budget, ulong, 0644);
+MODULE_PARM_DESC(cache_budget, "Bytes of computed results kept in the cache");
+
+static unsigned long cache_bytes;
+module_param(cache_bytes, ulong, 0444);
+MODULE_PARM_DESC(cache_bytes, "Bytes currently held by the cache");
+
+static unsigned long cache_hits;
+module_param(cache_hits, ulong, 0444);
+MODULE_PARM_DESC(cache_hits, "Number of reads served from the cache");
+
+static unsigned long cache_misses;
+module_param(cache_misses, ulong, 0444);
+MODULE_PARM_DESC(cache_misses, "Number of reads that had to compute");
+
+static DEFINE_HASHTABLE(fib_cache_table, FIB_CACHE_BITS);
+static LIST_HEAD(fib_cache_lru);
+static unsigned long fib_cache_nr;
+static DEFINE_SPINLOCK(fib_cache_lock);
+
+static inline size_t fib_entry_bytes(const struct fib_entry *e)
+{
+    return sizeof(struct fib_entry) + e->size * sizeof(uint64_t);
+}
+
+struct fib_entry *fib_entry_new(long long k, uint64_t *digits, size_t size)
+{
+    struct fib_entry *e = kmalloc(sizeof(struct fib_entry), GFP_KERNEL);
+    if (!e)
+        return NULL;
+    INIT_HLIST_NODE(&e->node);
+    INIT_LIST_HEAD(&e->lru);
+    refcount_set(&e->ref, 1);
+    e->k = k;
+    e->size = size;
+    e->digits = digits;
+    return e;
+}
+
+void fib_cache_put(struct fib_entry *e)
+{
+    if (e && refcount_dec_and_test(&e->ref)) {
+        kvfree(e->digits);
+        kfree(e);
+    }
+}
+
+/* fib_cache_lock must be held */
+static struct fib_entry *fib_cache_find(long long k)
+{
+    struct fib_entry *e;
+    hash_for_each_possible (fib_cache_table, e, node, k) {
+        if (e->k == k)
+            return e;
+    }
+    return NULL;
+}
+
+/*
+ * fib_cache_lock must be held
+ * The entry is moved to dispose and released by fib_cache_dispose once the
+ * lock is dropped, since freeing page backed digits may sleep
+ */
+static void fib_cache_evict(struct list_head *dispose)
+{
+    struct fib_entry *e =
+        list_first_entry(&fib_cache_lru, struct fib_entry, lru);
+    hash_del(&e->node);
+    list_move_tail(&e->lru, dispose);
+    cache_bytes -= fib_entry_bytes(e);
+    fib_cache_nr--;
+}
+
+static void fib_cache_dispose(struct list_head *dispose)
+{
+    struct fib_entry *e, *tmp;
+    list_for_each_entry_safe (e, tmp, dispose, lru) {
+        list_del_init(&e->lru);
+        fib_cache_put(e);
+    }
+}
+
+struct fib_entry *fib_cache_get(long long k)
+{
+    spin_lock(&fib_cache_lock);
+    struct fib_entry *e = fib_cache_find(k);
+    if (e) {
+        list_move_tail(&e->lru, &fib_cache_lru);
+        refcount_inc(&e->ref);
+        cache_hits++;
+    } else {
+        cache_misses++;
+    }
+    spin_unlock(&fib_cache_lock);
+    return e;
+}
+
+void fib_cache_add(struct fib_entry *e)
+{
+    size_t bytes = fib_entry_bytes(e);
+    if (bytes > READ_ONCE(cache_budget))
+        return;
+    LIST_HEAD(dispose);
+    spin_lock(&fib_cache_lock);
+    // another reader may have cached the same number meanwhile
+    if (fib_cache_find(e->k))
+        goto out;
+    while (cache_bytes + bytes > READ_ONCE(cache_budget) &&
+           !list_empty(&fib_cache_lru))
+        fib_cache_evict(&dispose);
+    refcount_inc(&e->ref);
+    hash_add(fib_cache_table, &e->node, e->k);
+    list_add_tail(&e->lru, &fib_cache_lru);
+    cache_bytes += bytes;
+    fib_cache_nr++;
+out:
+    spin_unlock(&fib_cache_lock);
+    fib_cache_dispose(&dispose);
+}
+
+static unsigned long fib_cache_count(struct shrinker *shrink,
+                                     struct shrink_control *sc)
+{
+    unsigned long nr = READ_ONCE(fib_cache_nr);
+    return nr ? nr : SHRINK_EMPTY;
+}
+
+static unsigned long fib_cache_scan(struct shrinker *shrink,
+                                    struct shrink_control *sc)
+{
+    unsigned long freed = 0;
+    LIST_HEAD(dispose);
+    spin_lock(&fib_cache_lock);
+    while (freed < sc->nr_to_scan && !list_empty(&fib_cache_lru)) {
+        fib_cache_evict(&dispose);
+        freed++;
+    }
+    spin_unlock(&fib_cache_lock);
+    fib_cache_dispose(&dispose);
+    return freed ? freed : SHRINK_STOP;
+}
+
+// shrinkers are allocated by the shrinker core since 6.7
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static struct shrinker *fib_cache_shrinker;
+#else
+static struct shrinker fib_cache_shrinker = {
+    .count_objects = fib_cache_count,
+    .scan_objects = fib_cache_scan,
+    .seeks = DEFAULT_SEEKS,
+};
+#endif
+
+int fib_cache_init(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    fib_cache_shrinker = shrinker_alloc(0, "fibdrv-cache");
+    if (!fib_cache_shrinker)
+        return -ENOMEM;
+    fib_cache_shrinker->count_objects = fib_cache_count;
+    fib_cache_shrinker->scan_objects = fib_cache_scan;
+    fib_cache_shrinker->seeks = DEFAULT_SEEKS;
+    shrinker_register(fib_cache_shrinker);
+    return 0;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+    return register_shrinker(&fib_cache_shrinker, "fibdrv-cache");
+#else
+    return register_shrinker(&fib_cache_shrinker);
+#endif
+}
+
+void fib_cache_exit(void)
+{
+    LIST_HEAD(dispose);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    shrinker_free(fib_cache_shrinker);
+#else
+    unregister_shrinker(&fib_cache_shrinker);
+#endif
+    spin_lock(&fib_cache_lock);
+    while (!list_empty(&fib_cache_lru))
+        fib_cache_evict(&dispose);
+    spin_unlock(&fib_cache_lock);
+    fib_cache_dispose(&dispose);
+}
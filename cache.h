@@ -0,0 +1,81 @@
+#ifndef __FIB_CACHE_H_
+#define __FIB_CACHE_H_
+
+#include <linux/list.h>
+#include <linux/refcount.h>
+#include <linux/types.h>
+
+/**
+ * fib_entry - a computed fibonacci number shared by the cache and readers
+ * An entry stays valid while a reference is held, even after the cache
+ * evicts it
+ * @node: link in the hash table of the cache
+ * @lru: link in the list of cached entries, least recently used first
+ * @ref: number of references held by the cache and by readers
+ * @k: index of the fibonacci number
+ * @size: number of limbs
+ * @digits: limbs of fib(k), least significant first
+ */
+struct fib_entry {
+    struct hlist_node node;
+    struct list_head lru;
+    refcount_t ref;
+    long long k;
+    size_t size;
+    uint64_t *digits;
+};
+
+/**
+ * fib_entry_new: wrap a computed fibonacci number into an entry
+ * The entry takes the ownership of digits on success
+ * @k: index of the fibonacci number
+ * @digits: limbs of fib(k) allocated by bn_to_array
+ * @size: number of limbs
+ * @return: the new entry with one reference, NULL if failed to allocate
+ * memory
+ */
+struct fib_entry *fib_entry_new(long long k, uint64_t *digits, size_t size);
+
+/**
+ * fib_cache_get: look up fib(k) in the cache
+ * A hit marks the entry as the most recently used one
+ * @k: index of the fibonacci number
+ * @return: the entry with a reference for the caller, NULL on a miss
+ */
+struct fib_entry *fib_cache_get(long long k);
+
+/**
+ * fib_cache_add: offer an entry to the cache
+ * Least recently used entries are evicted to stay within the budget, an
+ * entry larger than the whole budget is not cached
+ * @e: entry to be cached, the reference of the caller is left untouched
+ */
+void fib_cache_add(struct fib_entry *e);
+
+/**
+ * fib_entry_hold: take another reference to an entry
+ * @e: entry to be held
+ */
+static inline void fib_entry_hold(struct fib_entry *e)
+{
+    refcount_inc(&e->ref);
+}
+
+/**
+ * fib_cache_put: drop a reference to an entry
+ * @e: entry to be released
+ */
+void fib_cache_put(struct fib_entry *e);
+
+/**
+ * fib_cache_init: register the cache with the shrinker
+ * @return: 0 on success, negative error code otherwise
+ */
+int fib_cache_init(void);
+
+/**
+ * fib_cache_exit: unregister the shrinker and drop every cached entry
+ */
+void fib_cache_exit(void);
+
+#endif
@@ -1,12 +1,30 @@
 #include <linux/cdev.h>
+#include <linux/debugfs.h>
 #include <linux/device.h>
 #include <linux/fs.h>
 #include <linux/init.h>
 #include <linux/kdev_t.h>
 #include <linux/kernel.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/sched/signal.h>
+#include <linux/sort.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include "bench.h"
 #include "bn.h"
+#include "cache.h"
+#include "fibdrv.h"
+#include "ntt.h"
+#include "stats.h"
+#define CREATE_TRACE_POINTS
+#include "fibdrv_trace.h"
 
 MODULE_LICENSE("Dual MIT/GPL");
 MODULE_AUTHOR("National Cheng Kung University, Taiwan");
@@ -28,12 +46,131 @@ MODULE_VERSION("0.1");
         a = XOR_PTR(a, b); \
     } while (0)
 
+// products a doubling step runs at once, the caller and two workers
+#define FIB_PAR_WAYS 3
+
+// submissions of async mode calculated at once, each with its own scratch
+#define FIB_ASYNC_ACTIVE 4
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+#define fib_cancel_work(w) cancel_work(w)
+#else
+// the worker drops a cancelled submission as soon as it runs
+#define fib_cancel_work(w) false
+#endif
+
+static unsigned int par_limbs = 1024;
+module_param(par_limbs, uint, 0644);
+MODULE_PARM_DESC(par_limbs,
+                 "Limbs of fib(n) from which the products of a doubling step "
+                 "run in parallel, 0 to disable");
+
 static dev_t fib_dev = 0;
 static struct cdev *fib_cdev;
 static struct class *fib_class;
-static DEFINE_MUTEX(fib_mutex);
-static ktime_t kt;
-static uint8_t mode = 1;
+static struct workqueue_struct *fib_wq;
+static struct workqueue_struct *fib_async_wq;
+static struct dentry *fib_debugfs;
+
+/**
+ * fib_file - state of an open file of the device
+ * Every open file computes on its own, so independent readers run in parallel
+ * @lock: serializes the calculations on this file
+ * @mode: algorithm of the file, 1 for fast doubling and 0 for strassen
+ * @kt: time spent by the last calculation
+ * @scratch: working memory of fast doubling, one per product running at once,
+ * kept between reads
+ * @scratch_limbs: number of limbs the scratch is sized for
+ * @seq: fib(seq_k) and fib(seq_k + 1) left by the last read
+ * @seq_k: index of seq[0], -1 if seq is not valid
+ * @cur: result being read in chunks, NULL if none
+ * @pos: number of bytes of cur already read
+ * @done_k: index of the result whose last chunk has been read, so that
+ * further reads return 0 until the next seek, -1 if none
+ * @map_lock: protects map, which is taken by mmap without the file lock
+ * @map: page backed result prepared by FIB_IOC_LIMBS for mmap, NULL if none
+ * @range_k: index of the record being read in range mode, -1 if the file is
+ * not in range mode
+ * @range_last: index of the last record in range mode
+ * @range_pos: number of bytes of the record already read
+ * @async_lock: protects the submissions of async mode, which are finished
+ * by the workers without the file lock
+ * @async: true if the file is in async mode
+ * @async_gen: changed by every seek and by release, a submission made before
+ * it is dropped
+ * @async_nr: number of submissions not read yet
+ * @async_pending: number of submissions still being calculated
+ * @async_queue: submissions still being calculated, cancelled by release
+ * @async_done: finished submissions in the order they completed
+ * @async_wait: readers and pollers waiting for a submission to finish
+ * @async_cur: finished submission being read, NULL if none
+ * @async_pos: number of bytes of async_cur already read
+ */
+struct fib_file {
+    struct mutex lock;
+    uint8_t mode;
+    ktime_t kt;
+    bn_scratch *scratch[FIB_PAR_WAYS];
+    size_t scratch_limbs;
+    bn *seq[2];
+    long long seq_k;
+    struct fib_entry *cur;
+    size_t pos;
+    long long done_k;
+    spinlock_t map_lock;
+    struct fib_entry *map;
+    long long range_k;
+    long long range_last;
+    size_t range_pos;
+    spinlock_t async_lock;
+    bool async;
+    unsigned long async_gen;
+    unsigned int async_nr;
+    unsigned int async_pending;
+    struct list_head async_queue;
+    struct list_head async_done;
+    wait_queue_head_t async_wait;
+    struct fib_async *async_cur;
+    size_t async_pos;
+};
+
+/**
+ * fib_async - a submission of async mode
+ * @work: item queued on fib_async_wq
+ * @node: link in the queued or the finished submissions of the file
+ * @ff: state of the file
+ * @k: index of the fibonacci number
+ * @mode: algorithm of the file when k was submitted
+ * @gen: async_gen of the file when k was submitted
+ * @e: the result, NULL if the calculation failed
+ */
+struct fib_async {
+    struct work_struct work;
+    struct list_head node;
+    struct fib_file *ff;
+    long long k;
+    uint8_t mode;
+    unsigned long gen;
+    struct fib_entry *e;
+};
+
+static void fib_async_work(struct work_struct *work);
+
+/**
+ * fib_calc_stop: whether a calculation gives up between two steps
+ * A killed reader gives up, and so does a worker whose submission was
+ * dropped by a seek or by the release of its file
+ * @return: true if the calculation should give up
+ */
+static bool fib_calc_stop(void)
+{
+    struct work_struct *work = current_work();
+    if (work && work->func == fib_async_work) {
+        struct fib_async *req = container_of(work, struct fib_async, work);
+        return READ_ONCE(req->ff->async_gen) != req->gen;
+    }
+    return fatal_signal_pending(current);
+}
 
 // naive fibonacci calculation
 static inline size_t fib_sequence_naive(long long k, uint64_t **fib)
@@ -47,59 +184,178 @@ static inline size_t fib_sequence_naive(long long k, uint64_t **fib)
         (*fib)[0] = !!k;
         return 1;
     }
+    size_t ret = 0;
     BN_INIT_VAL(a, 1, 0);
     BN_INIT_VAL(b, 1, 1);
+    if (!a || !b)
+        goto out;
     for (int i = 2; i <= k; i++) {
-        bn_add(a, b);
+        if (fib_calc_stop() || bn_add(a, b))
+            goto out;
         XOR_SWAP(a, b);
+        bn_resched(bn_size(b));
     }
     *fib = bn_to_array(b);
-    size_t ret = bn_size(b);
+    ret = bn_size(b);
+out:
     bn_free(a);
     bn_free(b);
     return ret;
 }
 
-// fast doubling
-static inline void fast_doubling(struct list_head *fib_n0,
-                                 struct list_head *fib_n1,
-                                 struct list_head *fib_2n0,
-                                 struct list_head *fib_2n1)
+// fast doubling, returns 0 on success, -ENOMEM if failed to allocate memory
+static inline int fast_doubling(bn *fib_n0,
+                                bn *fib_n1,
+                                bn *fib_2n0,
+                                bn *fib_2n1,
+                                bn_scratch *s)
 {
     // fib(2n+1) = fib(n)^2 + fib(n+1)^2
     // use fib_2n0 to store the result temporarily
-    bn_mul(fib_n0, fib_n0, fib_2n1);
-    bn_mul(fib_n1, fib_n1, fib_2n0);
-    bn_add(fib_2n1, fib_2n0);
+    if (bn_fast_sqr(fib_n0, fib_2n1, s) || bn_fast_sqr(fib_n1, fib_2n0, s) ||
+        bn_add(fib_2n1, fib_2n0))
+        return -ENOMEM;
     // fib(2n) = fib(n) * (2 * fib(n+1) - fib(n))
-    bn_lshift(fib_n1, 1);
+    if (bn_lshift(fib_n1, 1))
+        return -ENOMEM;
     bn_sub(fib_n1, fib_n0);
-    bn_mul(fib_n1, fib_n0, fib_2n0);
+    return bn_fast_mul(fib_n1, fib_n0, fib_2n0, s);
 }
 
-static inline void fast_strassen(struct list_head *fib_n0,
-                                 struct list_head *fib_n1,
-                                 struct list_head *fib_2n0,
-                                 struct list_head *fib_2n1)
+/**
+ * fib_mul_work - a product of a doubling step handed to the workqueue
+ * @work: item queued on fib_wq
+ * @a: first operand
+ * @b: second operand, the same bn as a for a square
+ * @c: product
+ * @s: working memory owned by this product
+ * @rc: result of the product, read once the work is flushed
+ */
+struct fib_mul_work {
+    struct work_struct work;
+    bn *a;
+    bn *b;
+    bn *c;
+    bn_scratch *s;
+    int rc;
+};
+
+static void fib_mul_fn(struct work_struct *work)
 {
-    // fib(2n+1) = fib(n)^2 + fib(n+1)^2
-    // use fib_2n0 to store the result temporarily
-    bn_sqr_strassen(fib_n0, fib_2n1);
-    bn_sqr_strassen(fib_n1, fib_2n0);
-    bn_add(fib_2n1, fib_2n0);
+    struct fib_mul_work *w = container_of(work, struct fib_mul_work, work);
+    if (w->a == w->b)
+        w->rc = bn_fast_sqr(w->a, w->c, w->s);
+    else
+        w->rc = bn_fast_mul(w->a, w->b, w->c, w->s);
+}
+
+static void fib_mul_queue(struct fib_mul_work *w,
+                          bn *a,
+                          bn *b,
+                          bn *c,
+                          bn_scratch *s)
+{
+    w->a = a;
+    w->b = b;
+    w->c = c;
+    w->s = s;
+    INIT_WORK_ONSTACK(&w->work, fib_mul_fn);
+    queue_work(fib_wq, &w->work);
+}
+
+// fast doubling with the three products running at once, returns 0 on
+// success, -ENOMEM if failed to allocate memory
+static inline int fast_doubling_par(bn *fib_n0,
+                                    bn *fib_n1,
+                                    bn *fib_2n0,
+                                    bn *fib_2n1,
+                                    bn **tmp,
+                                    bn_scratch **s)
+{
+    struct fib_mul_work w[FIB_PAR_WAYS - 1];
+    // the products only read their operands once they are clean, so fib(n)
+    // can be shared between two of them
+    bn_clean(fib_n0);
+    bn_clean(fib_n1);
+    // 2 * fib(n+1) - fib(n) gets its own bn since fib(n+1) is still squared
+    if (bn_copy(tmp[0], fib_n1) || bn_lshift(tmp[0], 1))
+        return -ENOMEM;
+    __bn_sub(tmp[0], fib_n0);
+    fib_mul_queue(&w[0], fib_n0, fib_n0, fib_2n1, s[1]);
+    fib_mul_queue(&w[1], fib_n1, fib_n1, tmp[1], s[2]);
     // fib(2n) = fib(n) * (2 * fib(n+1) - fib(n))
-    bn_lshift(fib_n1, 1);
-    bn_sub(fib_n1, fib_n0);
-    bn_strassen(fib_n1, fib_n0, fib_2n0);
+    int rc = bn_fast_mul(tmp[0], fib_n0, fib_2n0, s[0]);
+    // the workers use the operands until they are flushed, even on failure
+    for (int i = 0; i < FIB_PAR_WAYS - 1; i++) {
+        flush_work(&w[i].work);
+        destroy_work_on_stack(&w[i].work);
+        if (w[i].rc)
+            rc = w[i].rc;
+    }
+    if (rc)
+        return rc;
+    // fib(2n+1) = fib(n)^2 + fib(n+1)^2
+    return bn_add(fib_2n1, tmp[1]);
+}
+
+static inline int fast_strassen(bn *fib_n0,
+                                bn *fib_n1,
+                                bn *fib_2n1,
+                                bn *fib_2n2,
+                                bn_scratch *s)
+{
+    // fib(2n+1) = fib(n)^2 + fib(n+1)^2
+    // fib(2n+2) = fib(n+1) * (2 * fib(n) + fib(n+1))
+    // both share the forward transforms of fib(n) and fib(n+1)
+    return bn_doubling_strassen(fib_n0, fib_n1, fib_2n1, fib_2n2, s);
+}
+
+/**
+ * fib_scratch_limbs: size of the scratch needed by fib_sequence
+ * The longest operand is 2 * fib(n+1) with n <= k / 2
+ * @param k: the index of the fibonacci number
+ * @return: number of limbs to be passed to bn_scratch_new
+ */
+static inline size_t fib_scratch_limbs(long long k)
+{
+    return bn_fib_limbs(k / 2 + 3) + 1;
+}
+
+/**
+ * fib_par_limbs: threshold of the parallel doubling steps of fib(k)
+ * Splitting a step costs a wakeup of two workers, which only pays off once
+ * the products take much longer than that
+ * @param k: the index of the fibonacci number
+ * @return: limbs of fib(n) from which a step runs in parallel, 0 if no step
+ * of fib(k) does
+ */
+static inline size_t fib_par_limbs(long long k)
+{
+    size_t limbs = READ_ONCE(par_limbs);
+    if (!limbs || !fib_wq || num_online_cpus() < 2 ||
+        bn_fib_limbs(k / 2) < limbs)
+        return 0;
+    return limbs;
 }
 
 /**
  * fib_sequence: calculate the fibonacci number with fast doubling algorithm.
  * It's a bottom up approach to avoid recursion.
  * @param k: the index of the fibonacci number
- * @return: the fibonacci number in char*
+ * @param s: FIB_PAR_WAYS working memories of at least fib_scratch_limbs(k)
+ * limbs, only the first one is needed if par is 0
+ * @param par: fib(n) of at least par limbs is doubled with the products
+ * running in parallel, 0 to run every step serially
+ * @param seq: if not NULL and k > 2, receives fib(k) and fib(k+1), the
+ * bns previously stored there are freed
+ * @return: the fibonacci number in char*, none if a fatal signal arrived
+ * during the calculation or memory ran out
  */
-static inline size_t fib_sequence(long long k, uint64_t **fib)
+static inline size_t fib_sequence(long long k,
+                                  uint64_t **fib,
+                                  bn_scratch **s,
+                                  size_t par,
+                                  bn **seq)
 {
     if (unlikely(k < 0)) {
         return 0;
@@ -112,42 +368,86 @@ static inline size_t fib_sequence(long long k, uint64_t **fib)
     }
     // starting from n = 1, fib[n] = 1, fib [n+1] = 1
     uint8_t count = 63 - CLZ(k);
-    BN_INIT_VAL(a, 0, 1);
-    BN_INIT_VAL(b, 1, 1);
-    BN_INIT_VAL(c, 0, 0);
-    BN_INIT_VAL(d, 0, 0);
+    // every value in the loop is below fib(k + 2), and a product takes at
+    // most one more limb before it is cleaned, so the buffers never grow
+    size_t cap = bn_fib_limbs(k + 2) + 2;
+    // fib_buf[0] = fib(n), fib_buf[1] = fib(n+1), the next two hold the next
+    // step and trade roles with them instead of being swapped, the last two
+    // are only needed by the parallel steps
+    bn *fib_buf[6] = {NULL};
+    int nbuf = par ? 6 : 4;
+    size_t res = 0;
+    for (int i = 0; i < nbuf; i++) {
+        fib_buf[i] = bn_alloc(cap);
+        if (!fib_buf[i])
+            goto out;
+    }
+    if (!s[0] || (par && (!s[1] || !s[2])))
+        goto out;
+    bn_set(fib_buf[0], 1);
+    bn_set(fib_buf[1], 1);
+    long allocs = bn_alloc_read();
     int n = 1;
     for (uint8_t i = count; i-- > 0;) {
-        fast_doubling(a, b, c, d);
-        // fast_strassen(a, b, c, d);
+        if (fib_calc_stop())
+            goto out;
+        u64 ts = fib_trace_start(trace_fib_doubling_step_enabled());
+        bn *fib_n0 = fib_buf[0], *fib_n1 = fib_buf[1];
+        bool step_par = par && bn_size(fib_n0) >= par;
+        int rc = step_par ? fast_doubling_par(fib_n0, fib_n1, fib_buf[2],
+                                              fib_buf[3], fib_buf + 4, s)
+                          : fast_doubling(fib_n0, fib_n1, fib_buf[2],
+                                          fib_buf[3], s[0]);
+        if (rc)
+            goto out;
         if (k & (1LL << i)) {
-            bn_add(c, d);
-            XOR_SWAP(a, d);
-            XOR_SWAP(b, c);
+            if (bn_add(fib_buf[2], fib_buf[3]))
+                goto out;
+            fib_buf[0] = fib_buf[3];
+            fib_buf[1] = fib_buf[2];
             n = 2 * n + 1;
         } else {
-            XOR_SWAP(a, c);
-            XOR_SWAP(b, d);
+            fib_buf[0] = fib_buf[2];
+            fib_buf[1] = fib_buf[3];
             n = 2 * n;
         }
+        fib_buf[2] = fib_n0;
+        fib_buf[3] = fib_n1;
+        trace_fib_doubling_step(n, bn_size(fib_buf[0]), step_par,
+                                fib_trace_ns(ts));
     }
-    *fib = bn_to_array(a);
-    size_t res = bn_size(a);
-
-    bn_free(a);
-    bn_free(b);
-    bn_free(c);
-    bn_free(d);
+    if (trace_fib_doubling_mem_enabled()) {
+        size_t bytes = nbuf * cap * sizeof(uint64_t);
+        for (int i = 0; i < (par ? FIB_PAR_WAYS : 1); i++)
+            bytes += bn_scratch_bytes(s[i]);
+        trace_fib_doubling_mem(k, bn_alloc_read() - allocs, bytes);
+    }
+    *fib = bn_to_array(fib_buf[0]);
+    res = bn_size(fib_buf[0]);
+    if (seq) {
+        swap(seq[0], fib_buf[0]);
+        swap(seq[1], fib_buf[1]);
+    }
+out:
+    for (int i = 0; i < 6; i++)
+        bn_free(fib_buf[i]);
     return res;
 }
 
 /**
  * fib_sequence: calculate the fibonacci number with fast doubling algorithm.
- * It's a bottom up approach to avoid recursion.
+ * It's a bottom up approach to avoid recursion. The buffers of the
+ * calculation, the transforms included, are allocated up front and released
+ * together at the end.
  * @param k: the index of the fibonacci number
- * @return: the fibonacci number in char*
+ * @param seq: if not NULL and k > 2, receives fib(k) and fib(k+1), the
+ * bns previously stored there are freed
+ * @return: the fibonacci number in char*, none if a fatal signal arrived
+ * during the calculation or memory ran out
  */
-static inline size_t fib_sequence_strassen(long long k, uint64_t **fib)
+static inline size_t fib_sequence_strassen(long long k,
+                                           uint64_t **fib,
+                                           bn **seq)
 {
     if (unlikely(k < 0)) {
         return 0;
@@ -160,100 +460,1007 @@ static inline size_t fib_sequence_strassen(long long k, uint64_t **fib)
     }
     // starting from n = 1, fib[n] = 1, fib [n+1] = 1
     uint8_t count = 63 - CLZ(k);
-    BN_INIT_VAL(a, 0, 1);
-    BN_INIT_VAL(b, 1, 1);
-    BN_INIT_VAL(c, 0, 0);
-    BN_INIT_VAL(d, 0, 0);
+    // every value in the loop is below fib(k + 2), and a product is carried
+    // into at most one more limb before it is cleaned
+    size_t cap = bn_fib_limbs(k + 2) + 2;
+    bn *a = bn_alloc(cap), *b = bn_alloc(cap);
+    bn *c = bn_alloc(cap), *d = bn_alloc(cap);
+    bn_scratch *s = bn_scratch_new_doubling(fib_scratch_limbs(k));
+    size_t res = 0;
+    if (!a || !b || !c || !d || !s)
+        goto out;
+    bn_set(a, 1);
+    bn_set(b, 1);
+    long allocs = bn_alloc_read();
     int n = 1;
     for (uint8_t i = count; i-- > 0;) {
-        fast_strassen(a, b, c, d);
+        if (fib_calc_stop())
+            goto out;
+        u64 ts = fib_trace_start(trace_fib_doubling_step_enabled());
+        if (fast_strassen(a, b, c, d, s))
+            goto out;
         if (k & (1LL << i)) {
-            bn_add(c, d);
-            XOR_SWAP(a, d);
-            XOR_SWAP(b, c);
-            n = 2 * n + 1;
-        } else {
             XOR_SWAP(a, c);
             XOR_SWAP(b, d);
+            n = 2 * n + 1;
+        } else {
+            // fib(2n) = fib(2n+2) - fib(2n+1)
+            __bn_sub(d, c);
+            XOR_SWAP(a, d);
+            XOR_SWAP(b, c);
             n = 2 * n;
         }
+        trace_fib_doubling_step(n, bn_size(a), false, fib_trace_ns(ts));
     }
+    if (trace_fib_doubling_mem_enabled())
+        trace_fib_doubling_mem(k, bn_alloc_read() - allocs,
+                               4 * cap * sizeof(uint64_t) +
+                                   bn_scratch_bytes(s));
     *fib = bn_to_array(a);
-    size_t res = bn_size(a);
-
+    res = bn_size(a);
+    if (seq) {
+        swap(seq[0], a);
+        swap(seq[1], b);
+    }
+out:
     bn_free(a);
     bn_free(b);
     bn_free(c);
     bn_free(d);
+    bn_scratch_free(s);
     return res;
 }
 
-static size_t fib_time_proxy(long long k, uint64_t **fib)
+/**
+ * fib_scratch_grow: make sure the file has enough working memory
+ * @ff: state of the file
+ * @limbs: number of limbs each working memory is sized for
+ * @ways: number of working memories needed
+ * @return: 0 on success, -ENOMEM if failed to allocate memory
+ */
+static int fib_scratch_grow(struct fib_file *ff, size_t limbs, int ways)
+{
+    if (ff->scratch_limbs < limbs) {
+        for (int i = 0; i < FIB_PAR_WAYS; i++) {
+            bn_scratch_free(ff->scratch[i]);
+            ff->scratch[i] = NULL;
+        }
+        ff->scratch_limbs = limbs;
+    }
+    for (int i = 0; i < ways; i++) {
+        if (!ff->scratch[i])
+            ff->scratch[i] = bn_scratch_new(ff->scratch_limbs);
+        if (!ff->scratch[i])
+            return -ENOMEM;
+    }
+    return 0;
+}
+
+static size_t fib_time_proxy(struct fib_file *ff, long long k, uint64_t **fib)
 {
     size_t ret = 0;
-    if (mode) {
-        printk(KERN_INFO "fibdrv: fast mode");
-        kt = ktime_get();
-        ret = fib_sequence(k, fib);
-        kt = ktime_sub(ktime_get(), kt);
+    if (ff->mode) {
+        size_t par = fib_par_limbs(k);
+        if (fib_scratch_grow(ff, fib_scratch_limbs(k),
+                             par ? FIB_PAR_WAYS : 1))
+            return 0;
+        ff->kt = ktime_get();
+        ret = fib_sequence(k, fib, ff->scratch, par, ff->seq);
+        ff->kt = ktime_sub(ktime_get(), ff->kt);
     } else {
-        printk(KERN_INFO "fibdrv: strassen mode");
-        kt = ktime_get();
-        ret = fib_sequence_strassen(k, fib);
-        kt = ktime_sub(ktime_get(), kt);
+        ff->kt = ktime_get();
+        ret = fib_sequence_strassen(k, fib, ff->seq);
+        ff->kt = ktime_sub(ktime_get(), ff->kt);
     }
+    if (*fib)
+        fib_stat_result(ff->mode ? FIB_STAT_FAST : FIB_STAT_STRASSEN,
+                        ktime_to_ns(ff->kt), ret);
+    else
+        fib_stat_failed();
+    // small numbers are returned before the pair is computed
+    ff->seq_k = *fib && k > 2 ? k : -1;
     return ret;
 }
 
-static size_t my_copy_to_user(char *buf, uint64_t *src, size_t size)
+// steps forward from the pair that are cheaper than calculating fib(k)
+#define FIB_SEQ_AHEAD(k) (2 * (fls64(k) + 1))
+
+/**
+ * fib_seq_move: move the pair left by the last read to fib(k)
+ * Each step forward is one addition and the step backward one subtraction
+ * @ff: state of the file
+ * @k: index of the fibonacci number
+ * @ahead: largest number of steps forward
+ * @return: true if the pair holds fib(k), false if k is out of reach or
+ * the pair could not grow, which drops it
+ */
+static bool fib_seq_move(struct fib_file *ff, long long k, long long ahead)
 {
-    size_t lbytes = src[size - 1] ? CLZ(src[size - 1]) >> 3 : 7;
-    size_t i = size * sizeof(uint64_t) - lbytes;
-    printk(KERN_INFO "fibdrv: list size %zu", size);
-    printk(KERN_INFO "fibdrv: total %zu bytes, copy_to_user %zu bytes",
-           size * sizeof(uint64_t), i);
-    // for (int j = 0; j < size; j++) {
-    //     printk(KERN_INFO "fibdrv[%i]: %llu", j, src[j]);
-    // }
-    return copy_to_user(buf, src, i);
+    if (ff->seq_k < 0 || k < ff->seq_k - 1 || k > ff->seq_k + ahead)
+        return false;
+    for (; ff->seq_k < k; ff->seq_k++) {
+        // fib(k+1) = fib(k) + fib(k-1), the pair is dropped if it can't grow
+        if (bn_add(ff->seq[0], ff->seq[1])) {
+            ff->seq_k = -1;
+            return false;
+        }
+        swap(ff->seq[0], ff->seq[1]);
+        bn_resched(bn_size(ff->seq[0]));
+    }
+    if (k == ff->seq_k - 1) {
+        // fib(k) = fib(k+2) - fib(k+1)
+        __bn_sub(ff->seq[1], ff->seq[0]);
+        swap(ff->seq[0], ff->seq[1]);
+        ff->seq_k = k;
+    }
+    return true;
 }
 
-static int fib_open(struct inode *inode, struct file *file)
+/**
+ * fib_seq_get: serve fib(k) from the pair left by the last read
+ * A neighbour of the pair is one addition or subtraction away, which makes
+ * a sweep over consecutive offsets linear in the size of the numbers
+ * @ff: state of the file
+ * @k: index of the fibonacci number
+ * @return: an entry that is not in the cache, NULL if k is not next to the
+ * pair or failed to allocate memory
+ */
+static struct fib_entry *fib_seq_get(struct fib_file *ff, long long k)
+{
+    if (!fib_seq_move(ff, k, 1))
+        return NULL;
+    uint64_t *fib = bn_to_array(ff->seq[0]);
+    struct fib_entry *e =
+        fib ? fib_entry_new(k, fib, bn_size(ff->seq[0])) : NULL;
+    if (!e)
+        kvfree(fib);
+    return e;
+}
+
+/**
+ * fib_copy_out: copy bytes of a result to the user
+ * @to: buffer in user space
+ * @from: the bytes
+ * @len: number of bytes
+ * @return: number of bytes that could not be copied
+ */
+static unsigned long fib_copy_out(char __user *to, const void *from, size_t len)
+{
+    u64 ts = fib_trace_start(trace_fib_copy_enabled());
+    unsigned long left = copy_to_user(to, from, len);
+    trace_fib_copy(len - left, fib_trace_ns(ts));
+    if (!left)
+        fib_stat_bytes(len);
+    return left;
+}
+
+static size_t __fib_bytes(const uint64_t *digits, size_t size)
+{
+    uint64_t top = digits[size - 1];
+    return size * sizeof(uint64_t) - (top ? CLZ(top) >> 3 : 7);
+}
+
+/**
+ * fib_bytes: number of bytes of a result returned to the user
+ * The leading zero bytes of the most significant limb are left out
+ * @e: the result
+ * @return: number of bytes
+ */
+static size_t fib_bytes(const struct fib_entry *e)
+{
+    return __fib_bytes(e->digits, e->size);
+}
+
+/**
+ * fib_calc_err: error of a calculation that returned no result
+ * The calculations give up once the calling task is killed, otherwise
+ * they only fail to allocate memory
+ * @return: -EINTR or -ENOMEM
+ */
+static inline int fib_calc_err(void)
+{
+    return fatal_signal_pending(current) ? -EINTR : -ENOMEM;
+}
+
+/**
+ * fib_result_calc: calculate fib(k) for a file and offer it to the cache
+ * The pair of the file is left at fib(k)
+ * @ff: state of the file, its lock must be held
+ * @k: index of the fibonacci number
+ * @return: the result with a reference for the caller, NULL if failed
+ */
+static struct fib_entry *fib_result_calc(struct fib_file *ff, long long k)
+{
+    uint64_t *fib = NULL;
+    size_t fib_size = fib_time_proxy(ff, k, &fib);
+    struct fib_entry *e = fib ? fib_entry_new(k, fib, fib_size) : NULL;
+    if (e)
+        fib_cache_add(e);
+    else
+        kvfree(fib);
+    return e;
+}
+
+/**
+ * fib_result_get: find or calculate fib(k) for a file
+ * Tries the pair of the last read, then the cache, and calculates on a miss
+ * @ff: state of the file, its lock must be held
+ * @k: index of the fibonacci number
+ * @return: the result with a reference for the caller, NULL if failed
+ */
+static struct fib_entry *fib_result_get(struct fib_file *ff, long long k)
+{
+    // a hit is served without any calculation, the neighbours of the last
+    // read are kept out of the cache so that a sweep does not flush it
+    ff->kt = ktime_get();
+    struct fib_entry *e = fib_seq_get(ff, k);
+    if (!e)
+        e = fib_cache_get(k);
+    ff->kt = ktime_sub(ktime_get(), ff->kt);
+    if (e)
+        fib_stat_result(FIB_STAT_CACHED, ktime_to_ns(ff->kt), e->size);
+    else
+        e = fib_result_calc(ff, k);
+    return e;
+}
+
+/**
+ * fib_stream_reset: drop the result being read by a file
+ * @ff: state of the file, its lock must be held
+ */
+static void fib_stream_reset(struct fib_file *ff)
+{
+    fib_cache_put(ff->cur);
+    ff->cur = NULL;
+    ff->pos = 0;
+    ff->done_k = -1;
+}
+
+/**
+ * fib_map_get: find or calculate fib(k) in memory that can be mapped
+ * A result small enough to live in the slab is copied to pages of its own,
+ * the copy is left out of the cache
+ * @ff: state of the file, its lock must be held
+ * @k: index of the fibonacci number
+ * @return: the result with a reference for the caller, NULL if failed
+ */
+static struct fib_entry *fib_map_get(struct fib_file *ff, long long k)
+{
+    struct fib_entry *e = fib_result_get(ff, k), *copy = NULL;
+    if (!e || is_vmalloc_addr(e->digits))
+        return e;
+    uint64_t *digits = vmalloc_user(e->size * sizeof(uint64_t));
+    if (digits) {
+        memcpy(digits, e->digits, e->size * sizeof(uint64_t));
+        copy = fib_entry_new(k, digits, e->size);
+        if (!copy)
+            vfree(digits);
+    }
+    fib_cache_put(e);
+    return copy;
+}
+
+/**
+ * fib_seq_seed: leave fib(k) and fib(k+1) in the pair of a file
+ * The pair is moved if k is within reach and calculated otherwise
+ * @ff: state of the file, its lock must be held
+ * @k: index of the fibonacci number
+ * @return: 0 on success, negative error code from fib_calc_err otherwise
+ */
+static int fib_seq_seed(struct fib_file *ff, long long k)
 {
-    if (!mutex_trylock(&fib_mutex)) {
-        printk(KERN_ALERT "fibdrv is in use");
-        return -EBUSY;
+    if (fib_seq_move(ff, k, FIB_SEQ_AHEAD(k)))
+        return 0;
+    if (k > 2) {
+        uint64_t *fib = NULL;
+        fib_time_proxy(ff, k, &fib);
+        kvfree(fib);
+        return ff->seq_k == k ? 0 : fib_calc_err();
+    }
+    // the calculation does not fill the pair for small numbers
+    for (int i = 0; i < 2; i++) {
+        if (!ff->seq[i] && !(ff->seq[i] = bn_alloc(1)))
+            return -ENOMEM;
     }
+    bn_set(ff->seq[0], k > 0);
+    bn_set(ff->seq[1], k < 2 ? 1 : 2);
+    ff->seq_k = k;
+    return 0;
+}
+
+/**
+ * fib_async_calc: find or calculate fib(k) without the state of a file
+ * The scratch is allocated for this calculation alone, so the submissions
+ * run next to the reads of their file. fib_async_wq runs at most
+ * FIB_ASYNC_ACTIVE of them at once, which bounds the memory they hold.
+ * @k: index of the fibonacci number
+ * @mode: algorithm, 1 for fast doubling and 0 for strassen
+ * @return: the result with a reference for the caller, NULL if failed
+ */
+static struct fib_entry *fib_async_calc(long long k, uint8_t mode)
+{
+    ktime_t kt = ktime_get();
+    struct fib_entry *e = fib_cache_get(k);
+    if (e) {
+        kt = ktime_sub(ktime_get(), kt);
+        fib_stat_result(FIB_STAT_CACHED, ktime_to_ns(kt), e->size);
+        return e;
+    }
+    uint64_t *fib = NULL;
+    size_t size;
+    if (mode) {
+        size_t par = fib_par_limbs(k);
+        bn_scratch *s[FIB_PAR_WAYS] = {NULL};
+        for (int i = 0; i < (par ? FIB_PAR_WAYS : 1); i++)
+            s[i] = bn_scratch_new(fib_scratch_limbs(k));
+        size = fib_sequence(k, &fib, s, par, NULL);
+        for (int i = 0; i < FIB_PAR_WAYS; i++)
+            bn_scratch_free(s[i]);
+    } else {
+        size = fib_sequence_strassen(k, &fib, NULL);
+    }
+    kt = ktime_sub(ktime_get(), kt);
+    if (fib)
+        fib_stat_result(mode ? FIB_STAT_FAST : FIB_STAT_STRASSEN,
+                        ktime_to_ns(kt), size);
+    else if (!fib_calc_stop())
+        fib_stat_failed();
+    e = fib ? fib_entry_new(k, fib, size) : NULL;
+    if (e)
+        fib_cache_add(e);
+    else
+        kvfree(fib);
+    return e;
+}
+
+static void fib_async_free(struct fib_async *req)
+{
+    fib_cache_put(req->e);
+    kfree(req);
+}
+
+static void fib_async_work(struct work_struct *work)
+{
+    struct fib_async *req = container_of(work, struct fib_async, work);
+    struct fib_file *ff = req->ff;
+    if (!fib_calc_stop())
+        req->e = fib_async_calc(req->k, req->mode);
+    spin_lock(&ff->async_lock);
+    ff->async_pending--;
+    if (req->gen == ff->async_gen) {
+        list_move_tail(&req->node, &ff->async_done);
+        req = NULL;
+    } else {
+        list_del(&req->node);
+        ff->async_nr--;
+    }
+    // the file may be released once the lock is dropped
+    wake_up(&ff->async_wait);
+    spin_unlock(&ff->async_lock);
+    if (req)
+        fib_async_free(req);
+}
+
+/**
+ * fib_async_submit: calculate fib(k) in the background
+ * The file enters async mode, leaving the result or the range being read
+ * @ff: state of the file
+ * @k: index of the fibonacci number
+ * @return: 0 on success, negative error code otherwise
+ */
+static int fib_async_submit(struct fib_file *ff, long long k)
+{
+    if (k < 0 || k > MAX_LENGTH)
+        return -EINVAL;
+    struct fib_async *req = kzalloc(sizeof(struct fib_async), GFP_KERNEL);
+    if (!req)
+        return -ENOMEM;
+    INIT_WORK(&req->work, fib_async_work);
+    INIT_LIST_HEAD(&req->node);
+    req->ff = ff;
+    req->k = k;
+    int rc = 0;
+    mutex_lock(&ff->lock);
+    fib_stream_reset(ff);
+    ff->range_k = -1;
+    req->mode = ff->mode;
+    spin_lock(&ff->async_lock);
+    if (ff->async_nr < FIB_ASYNC_MAX) {
+        ff->async = true;
+        ff->async_nr++;
+        ff->async_pending++;
+        req->gen = ff->async_gen;
+        list_add_tail(&req->node, &ff->async_queue);
+    } else {
+        rc = -EAGAIN;
+    }
+    spin_unlock(&ff->async_lock);
+    mutex_unlock(&ff->lock);
+    if (rc)
+        kfree(req);
+    else
+        queue_work(fib_async_wq, &req->work);
+    return rc;
+}
+
+/**
+ * fib_async_reset: leave async mode
+ * Finished submissions are dropped, the ones still being calculated are
+ * dropped once they finish
+ * @ff: state of the file, its lock must be held
+ */
+static void fib_async_reset(struct fib_file *ff)
+{
+    LIST_HEAD(dispose);
+    struct fib_async *req, *tmp;
+    spin_lock(&ff->async_lock);
+    ff->async = false;
+    ff->async_gen++;
+    list_splice_init(&ff->async_done, &dispose);
+    list_for_each_entry (req, &dispose, node)
+        ff->async_nr--;
+    if (ff->async_cur)
+        ff->async_nr--;
+    spin_unlock(&ff->async_lock);
+    list_for_each_entry_safe (req, tmp, &dispose, node)
+        fib_async_free(req);
+    if (ff->async_cur)
+        fib_async_free(ff->async_cur);
+    ff->async_cur = NULL;
+    ff->async_pos = 0;
+}
+
+/**
+ * fib_async_cancel: drop the submissions still being calculated
+ * The ones not started yet are taken off fib_async_wq, the running ones give
+ * up at their next step
+ * @ff: state of the file
+ */
+static void fib_async_cancel(struct fib_file *ff)
+{
+    LIST_HEAD(dispose);
+    struct fib_async *req, *tmp;
+    spin_lock(&ff->async_lock);
+    ff->async_gen++;
+    list_for_each_entry_safe (req, tmp, &ff->async_queue, node) {
+        if (fib_cancel_work(&req->work)) {
+            list_move_tail(&req->node, &dispose);
+            ff->async_pending--;
+            ff->async_nr--;
+        }
+    }
+    spin_unlock(&ff->async_lock);
+    list_for_each_entry_safe (req, tmp, &dispose, node)
+        fib_async_free(req);
+}
+
+static bool fib_async_idle(struct fib_file *ff)
+{
+    spin_lock(&ff->async_lock);
+    bool idle = !ff->async_pending;
+    spin_unlock(&ff->async_lock);
+    return idle;
+}
+
+// a read of async mode would not wait
+static bool fib_async_ready(struct fib_file *ff)
+{
+    spin_lock(&ff->async_lock);
+    bool ready =
+        !ff->async || !list_empty(&ff->async_done) || !ff->async_pending;
+    spin_unlock(&ff->async_lock);
+    return ready;
+}
+
+/**
+ * fib_async_read: read the finished submissions of async mode
+ * Each one is read as a struct fib_record followed by the bytes of fib(k).
+ * Waits for the first one unless the file is non-blocking, further records
+ * are only read if already finished.
+ * @ff: state of the file, its lock must be held and is dropped while waiting
+ * @file: the file
+ * @buf: buffer in user space
+ * @size: size of the buffer
+ * @return: number of bytes read, 0 if nothing is outstanding, negative
+ * error code if nothing could be read
+ */
+static ssize_t fib_async_read(struct fib_file *ff,
+                              struct file *file,
+                              char __user *buf,
+                              size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        if (!ff->async_cur) {
+            spin_lock(&ff->async_lock);
+            struct fib_async *next = list_first_entry_or_null(
+                &ff->async_done, struct fib_async, node);
+            if (next)
+                list_del_init(&next->node);
+            bool idle = !ff->async || !ff->async_pending;
+            spin_unlock(&ff->async_lock);
+            if (!next) {
+                if (done || idle)
+                    break;
+                if (file->f_flags & O_NONBLOCK)
+                    return -EAGAIN;
+                mutex_unlock(&ff->lock);
+                int rc = wait_event_interruptible(ff->async_wait,
+                                                  fib_async_ready(ff));
+                mutex_lock(&ff->lock);
+                if (rc)
+                    return rc;
+                continue;
+            }
+            ff->async_cur = next;
+            ff->async_pos = 0;
+        }
+        struct fib_async *req = ff->async_cur;
+        struct fib_record rec = {
+            .k = req->k,
+            .size = req->e ? fib_bytes(req->e) : 0,
+        };
+        const char *src;
+        size_t len;
+        if (ff->async_pos < sizeof(rec)) {
+            src = (const char *) &rec + ff->async_pos;
+            len = sizeof(rec) - ff->async_pos;
+        } else {
+            src = (const char *) req->e->digits + ff->async_pos - sizeof(rec);
+            len = sizeof(rec) + rec.size - ff->async_pos;
+        }
+        len = min(len, size - done);
+        if (fib_copy_out(buf + done, src, len))
+            return done ? done : -EFAULT;
+        done += len;
+        ff->async_pos += len;
+        if (ff->async_pos == sizeof(rec) + rec.size) {
+            spin_lock(&ff->async_lock);
+            ff->async_nr--;
+            spin_unlock(&ff->async_lock);
+            fib_async_free(req);
+            ff->async_cur = NULL;
+            ff->async_pos = 0;
+        }
+    }
+    return done;
+}
+
+/**
+ * fib_range_start: switch a file to range mode
+ * @ff: state of the file
+ * @first: index of the first record
+ * @last: index of the last record
+ * @return: 0 on success, negative error code otherwise
+ */
+static int fib_range_start(struct fib_file *ff, long long first, long long last)
+{
+    if (first < 0 || first > last || last > MAX_LENGTH)
+        return -EINVAL;
+    mutex_lock(&ff->lock);
+    fib_stream_reset(ff);
+    fib_async_reset(ff);
+    int rc = fib_seq_seed(ff, first);
+    ff->range_k = rc ? -1 : first;
+    ff->range_last = last;
+    ff->range_pos = 0;
+    mutex_unlock(&ff->lock);
+    return rc;
+}
+
+/**
+ * fib_range_read: read the records of range mode
+ * A record is the number of bytes of fib(k) as a 64-bit number followed by
+ * those bytes. The pair of the file is stepped by one addition once a record
+ * has been read, so a range takes memory for two numbers however long it is.
+ * @ff: state of the file, its lock must be held
+ * @buf: buffer in user space
+ * @size: size of the buffer
+ * @return: number of bytes read, 0 after the last record, negative error
+ * code if nothing could be read
+ */
+static ssize_t fib_range_read(struct fib_file *ff,
+                              char __user *buf,
+                              size_t size)
+{
+    size_t done = 0;
+    while (done < size && ff->range_k <= ff->range_last) {
+        // another read of this file may have moved the pair
+        int rc = fib_seq_seed(ff, ff->range_k);
+        if (rc)
+            return done ? done : rc;
+        const bn *f = ff->seq[0];
+        u64 bytes = __fib_bytes(f->digits, bn_size(f));
+        const char *src;
+        size_t len;
+        if (ff->range_pos < sizeof(bytes)) {
+            src = (const char *) &bytes + ff->range_pos;
+            len = sizeof(bytes) - ff->range_pos;
+        } else {
+            src = (const char *) f->digits + ff->range_pos - sizeof(bytes);
+            len = sizeof(bytes) + bytes - ff->range_pos;
+        }
+        len = min(len, size - done);
+        if (fib_copy_out(buf + done, src, len))
+            return done ? done : -EFAULT;
+        done += len;
+        ff->range_pos += len;
+        if (ff->range_pos == sizeof(bytes) + bytes) {
+            ff->range_pos = 0;
+            ff->range_k++;
+        }
+    }
+    return done;
+}
+
+static int fib_open(struct inode *inode, struct file *file)
+{
+    struct fib_file *ff = kzalloc(sizeof(struct fib_file), GFP_KERNEL);
+    if (!ff)
+        return -ENOMEM;
+    mutex_init(&ff->lock);
+    ff->mode = 1;
+    ff->seq_k = -1;
+    ff->done_k = -1;
+    spin_lock_init(&ff->map_lock);
+    ff->range_k = -1;
+    spin_lock_init(&ff->async_lock);
+    INIT_LIST_HEAD(&ff->async_queue);
+    INIT_LIST_HEAD(&ff->async_done);
+    init_waitqueue_head(&ff->async_wait);
+    file->private_data = ff;
     return 0;
 }
 
 static int fib_release(struct inode *inode, struct file *file)
 {
-    mutex_unlock(&fib_mutex);
+    struct fib_file *ff = file->private_data;
+    fib_async_cancel(ff);
+    // the workers still calculating for this file refer to it
+    wait_event(ff->async_wait, fib_async_idle(ff));
+    fib_async_reset(ff);
+    fib_cache_put(ff->cur);
+    fib_cache_put(ff->map);
+    for (int i = 0; i < FIB_PAR_WAYS; i++)
+        bn_scratch_free(ff->scratch[i]);
+    bn_free(ff->seq[0]);
+    bn_free(ff->seq[1]);
+    mutex_destroy(&ff->lock);
+    kfree(ff);
     return 0;
 }
 
-/* calculate the fibonacci number at given offset */
+/*
+ * calculate the fibonacci number at given offset
+ * The result is returned as little endian bytes, in chunks of at most size
+ * bytes. It is kept until the last chunk is read, after which read returns
+ * 0 until the file seeks again.
+ */
 static ssize_t fib_read(struct file *file,
                         char *buf,
                         size_t size,
                         loff_t *offset)
 {
-    printk(KERN_INFO "fibdrv: reading on offset %lld \n", *offset);
-    uint64_t *fib = NULL;
-    size_t fib_size = fib_time_proxy(*offset, &fib);
-    if (!fib) {
-        printk(KERN_INFO "fibdrv: calculation failed\n");
-        return -EFAULT;
+    struct fib_file *ff = file->private_data;
+    long long k = *offset;
+    ssize_t ret;
+    mutex_lock(&ff->lock);
+    trace_fib_request_start(k, ff->mode);
+    if (ff->async) {
+        ret = fib_async_read(ff, file, buf, size);
+        goto out;
+    }
+    if (ff->range_k >= 0) {
+        ret = fib_range_read(ff, buf, size);
+        goto out;
+    }
+    if (ff->cur && ff->cur->k != k)
+        fib_stream_reset(ff);
+    if (!ff->cur) {
+        if (ff->done_k == k) {
+            ret = 0;
+            goto out;
+        }
+        ff->done_k = -1;
+        ff->cur = fib_result_get(ff, k);
+        if (!ff->cur) {
+            printk(KERN_INFO "fibdrv: calculation failed\n");
+            ret = fib_calc_err();
+            goto out;
+        }
     }
-    printk(KERN_INFO "fibdrv: read\n");
-    if (my_copy_to_user(buf, fib, fib_size)) {
+    size_t total = fib_bytes(ff->cur);
+    size_t len = min(size, total - ff->pos);
+    if (fib_copy_out(buf, (char *) ff->cur->digits + ff->pos, len)) {
         printk(KERN_INFO "fibdrv: copy to user failed\n");
+        ret = -EFAULT;
+        goto out;
+    }
+    ff->pos += len;
+    if (ff->pos == total) {
+        fib_stream_reset(ff);
+        ff->done_k = k;
+    }
+    ret = len;
+out:
+    trace_fib_request_end(k, ret);
+    mutex_unlock(&ff->lock);
+    return ret;
+}
+
+/**
+ * fib_batch_work - an item of a batch in the order it is calculated
+ * @k: index of the fibonacci number
+ * @i: position of the item in the batch of the user
+ */
+struct fib_batch_work {
+    long long k;
+    u32 i;
+};
+
+static int fib_batch_cmp(const void *a, const void *b)
+{
+    const struct fib_batch_work *x = a, *y = b;
+    return x->k < y->k ? -1 : x->k > y->k;
+}
+
+/**
+ * fib_batch_copy: copy a result into the buffer of a batch item
+ * @buf: buffer of the batch
+ * @item: the item, its size is set to the number of bytes of the result
+ * @digits: limbs of the result
+ * @size: number of limbs
+ * @return: 0 on success, -EFAULT if failed to copy
+ */
+static int fib_batch_copy(char __user *buf,
+                          struct fib_batch_item *item,
+                          const uint64_t *digits,
+                          size_t size)
+{
+    item->size = __fib_bytes(digits, size);
+    size_t len = min_t(u64, item->len, item->size);
+    return fib_copy_out(buf + item->offset, digits, len) ? -EFAULT : 0;
+}
+
+/**
+ * fib_batch_run: calculate every item of a batch in one call
+ * Items are calculated in increasing order of k, so that an index shortly
+ * after the previous one is reached by additions from the pair of the file
+ * instead of a calculation of its own. Fast doubling takes log2(k) steps of
+ * at least two multiplications each, which is never cheaper than that many
+ * additions. An item followed by such a neighbour is calculated even on a
+ * hit of the cache, since the hit would leave the pair behind.
+ * @ff: state of the file
+ * @arg: the batch in user space
+ * @return: 0 on success, negative error code otherwise
+ */
+static long fib_batch_run(struct fib_file *ff, struct fib_batch __user *arg)
+{
+    struct fib_batch batch;
+    if (copy_from_user(&batch, arg, sizeof(batch)))
         return -EFAULT;
-    };
-    printk(KERN_INFO "fibdrv: copy to user success\n");
-    kfree(fib);
-    return ktime_to_ns(kt);
+    if (batch.pad)
+        return -EINVAL;
+    if (!batch.count)
+        return 0;
+    if (batch.count > FIB_BATCH_MAX)
+        return -E2BIG;
+    struct fib_batch_item __user *uitems = u64_to_user_ptr(batch.items);
+    char __user *buf = u64_to_user_ptr(batch.buf);
+    struct fib_batch_item *items =
+        kvmalloc_array(batch.count, sizeof(*items), GFP_KERNEL);
+    struct fib_batch_work *work =
+        kvmalloc_array(batch.count, sizeof(*work), GFP_KERNEL);
+    long rc = 0;
+    if (!items || !work) {
+        rc = -ENOMEM;
+        goto out;
+    }
+    if (copy_from_user(items, uitems, batch.count * sizeof(*items))) {
+        rc = -EFAULT;
+        goto out;
+    }
+    for (u32 i = 0; i < batch.count; i++) {
+        if (items[i].k > MAX_LENGTH) {
+            rc = -EINVAL;
+            goto out;
+        }
+        work[i].k = items[i].k;
+        work[i].i = i;
+    }
+    sort(work, batch.count, sizeof(*work), fib_batch_cmp, NULL);
+
+    mutex_lock(&ff->lock);
+    ktime_t kt = ktime_get();
+    for (u32 j = 0; j < batch.count && !rc; j++) {
+        struct fib_batch_item *item = &items[work[j].i];
+        long long k = work[j].k;
+        if (fib_seq_move(ff, k, FIB_SEQ_AHEAD(k))) {
+            rc = fib_batch_copy(buf, item, ff->seq[0]->digits,
+                                bn_size(ff->seq[0]));
+        } else {
+            long long next = j + 1 < batch.count ? work[j + 1].k : -1;
+            struct fib_entry *e = next >= 0 && next - k <= FIB_SEQ_AHEAD(next)
+                                      ? fib_result_calc(ff, k)
+                                      : fib_result_get(ff, k);
+            rc = e ? fib_batch_copy(buf, item, e->digits, e->size)
+                   : fib_calc_err();
+            fib_cache_put(e);
+        }
+        // an item ends where the next one starts
+        ktime_t end = ktime_get();
+        item->ns = ktime_to_ns(ktime_sub(end, kt));
+        kt = end;
+    }
+    mutex_unlock(&ff->lock);
+    if (!rc && copy_to_user(uitems, items, batch.count * sizeof(*items)))
+        rc = -EFAULT;
+out:
+    kvfree(work);
+    kvfree(items);
+    return rc;
+}
+
+/**
+ * fib_mod_run: calculate fib(k) modulo a number given by the user
+ * The index is taken from the argument instead of the offset, so it is not
+ * limited to MAX_LENGTH
+ * @ff: state of the file
+ * @arg: the request in user space
+ * @return: 0 on success, negative error code otherwise
+ */
+static long fib_mod_run(struct fib_file *ff, struct fib_modulo __user *arg)
+{
+    struct fib_modulo req;
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+    if (req.pad || !req.limbs || req.limbs > FIB_MOD_LIMBS)
+        return -EINVAL;
+    uint64_t *m = kmalloc_array(2 * req.limbs, sizeof(uint64_t), GFP_KERNEL);
+    if (!m)
+        return -ENOMEM;
+    uint64_t *res = m + req.limbs;
+    long rc = 0;
+    if (req.m && copy_from_user(m, u64_to_user_ptr(req.m),
+                                req.limbs * sizeof(uint64_t))) {
+        rc = -EFAULT;
+        goto out;
+    }
+    ktime_t kt = ktime_get();
+    rc = bn_fib_mod(req.k, req.m ? m : NULL, req.limbs, res);
+    kt = ktime_sub(ktime_get(), kt);
+    if (!rc && copy_to_user(u64_to_user_ptr(req.res), res,
+                            req.limbs * sizeof(uint64_t)))
+        rc = -EFAULT;
+    mutex_lock(&ff->lock);
+    ff->kt = kt;
+    mutex_unlock(&ff->lock);
+out:
+    kfree(m);
+    return rc;
+}
+
+/**
+ * fib_lead_run: leading digits of fib(k) requested by the user
+ * @ff: state of the file
+ * @arg: the request in user space, the digits are written back to it
+ * @return: 0 on success, negative error code otherwise
+ */
+static long fib_lead_run(struct fib_file *ff, struct fib_lead __user *arg)
+{
+    struct fib_lead req;
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+    ktime_t kt = ktime_get();
+    uint64_t lead, exp;
+    int rc = bn_fib_lead(req.k, req.base, req.digits, &lead, &exp);
+    kt = ktime_sub(ktime_get(), kt);
+    mutex_lock(&ff->lock);
+    ff->kt = kt;
+    mutex_unlock(&ff->lock);
+    if (rc)
+        return rc;
+    req.lead = lead;
+    req.exp = exp;
+    return copy_to_user(arg, &req, sizeof(req)) ? -EFAULT : 0;
+}
+
+static long fib_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct fib_file *ff = file->private_data;
+    switch (cmd) {
+    case FIB_IOC_TIME: {
+        mutex_lock(&ff->lock);
+        __u64 ns = ktime_to_ns(ff->kt);
+        mutex_unlock(&ff->lock);
+        return put_user(ns, (__u64 __user *) arg);
+    }
+    case FIB_IOC_LIMBS: {
+        mutex_lock(&ff->lock);
+        struct fib_entry *e = fib_map_get(ff, file->f_pos);
+        mutex_unlock(&ff->lock);
+        if (!e)
+            return fib_calc_err();
+        __u64 limbs = e->size;
+        spin_lock(&ff->map_lock);
+        swap(ff->map, e);
+        spin_unlock(&ff->map_lock);
+        fib_cache_put(e);
+        return put_user(limbs, (__u64 __user *) arg);
+    }
+    case FIB_IOC_BATCH:
+        return fib_batch_run(ff, (struct fib_batch __user *) arg);
+    case FIB_IOC_RANGE: {
+        struct fib_range range;
+        if (copy_from_user(&range, (void __user *) arg, sizeof(range)))
+            return -EFAULT;
+        if (range.first > MAX_LENGTH || range.last > MAX_LENGTH)
+            return -EINVAL;
+        return fib_range_start(ff, range.first, range.last);
+    }
+    case FIB_IOC_MOD:
+        return fib_mod_run(ff, (struct fib_modulo __user *) arg);
+    case FIB_IOC_LEAD:
+        return fib_lead_run(ff, (struct fib_lead __user *) arg);
+    case FIB_IOC_SUBMIT: {
+        __u64 k;
+        if (get_user(k, (__u64 __user *) arg))
+            return -EFAULT;
+        if (k > MAX_LENGTH)
+            return -EINVAL;
+        return fib_async_submit(ff, k);
+    }
+    default:
+        return -ENOTTY;
+    }
+}
+
+static void fib_vm_open(struct vm_area_struct *vma)
+{
+    fib_entry_hold(vma->vm_private_data);
+}
+
+static void fib_vm_close(struct vm_area_struct *vma)
+{
+    fib_cache_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct fib_vm_ops = {
+    .open = fib_vm_open,
+    .close = fib_vm_close,
+};
+
+/*
+ * map the result prepared by FIB_IOC_LIMBS read-only
+ * The mapping holds its own reference, so the pages stay valid until
+ * unmapped even if the file is closed or prepares another result
+ */
+static int fib_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct fib_file *ff = file->private_data;
+    if (vma->vm_flags & (VM_WRITE | VM_EXEC))
+        return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE | VM_MAYEXEC);
+#else
+    vma->vm_flags &= ~(VM_MAYWRITE | VM_MAYEXEC);
+#endif
+    spin_lock(&ff->map_lock);
+    struct fib_entry *e = ff->map;
+    if (e)
+        fib_entry_hold(e);
+    spin_unlock(&ff->map_lock);
+    if (!e)
+        return -EINVAL;
+    // checks that the range fits in the pages of the result
+    int rc = remap_vmalloc_range(vma, e->digits, vma->vm_pgoff);
+    if (rc) {
+        fib_cache_put(e);
+        return rc;
+    }
+    vma->vm_private_data = e;
+    vma->vm_ops = &fib_vm_ops;
+    return 0;
 }
 
 /* write operation is skipped */
@@ -262,15 +1469,28 @@ static ssize_t fib_write(struct file *file,
                          size_t size,
                          loff_t *offset)
 {
-    printk(KERN_INFO "fibdrv: writing on offset %lld \n", *offset);
-    char *kbuf = kmalloc(size, GFP_KERNEL);
-    if (copy_from_user(kbuf, buf, size)) {
+    struct fib_file *ff = file->private_data;
+    char cmd[48];
+    size_t len = min(size, sizeof(cmd) - 1);
+    if (!size || copy_from_user(cmd, buf, len)) {
         printk(KERN_INFO "fibdrv: copy from user failed\n");
         return -EFAULT;
     };
-    printk(KERN_INFO "fibdrv: copy from user success\n");
-    mode = !!(int) (kbuf[0] - 'n');
-    kfree(kbuf);
+    cmd[len] = '\0';
+    long long first, last;
+    if (sscanf(cmd, "range %lld %lld", &first, &last) == 2) {
+        int rc = fib_range_start(ff, first, last);
+        return rc ? rc : size;
+    }
+    if (sscanf(cmd, "submit %lld", &first) == 1) {
+        int rc = fib_async_submit(ff, first);
+        return rc ? rc : size;
+    }
+    // otherwise only the first character selects the mode of this file
+    uint8_t mode = !!(int) (cmd[0] - 'n');
+    mutex_lock(&ff->lock);
+    ff->mode = mode;
+    mutex_unlock(&ff->lock);
     return mode;
 }
 
@@ -292,11 +1512,38 @@ static loff_t fib_device_lseek(struct file *file, loff_t offset, int orig)
     if (new_pos > MAX_LENGTH)
         new_pos = MAX_LENGTH;  // max case
     if (new_pos < 0)
-        new_pos = 0;        // min case
+        new_pos = 0;  // min case
+    // seeking starts the result over, even at the same offset, and leaves
+    // the range mode
+    struct fib_file *ff = file->private_data;
+    mutex_lock(&ff->lock);
+    fib_stream_reset(ff);
+    ff->range_k = -1;
+    fib_async_reset(ff);
     file->f_pos = new_pos;  // This is what we'll use now
+    mutex_unlock(&ff->lock);
     return new_pos;
 }
 
+/*
+ * a file in async mode is readable once a submission has finished or none
+ * is left, any other file calculates on the spot when read
+ */
+static __poll_t fib_poll(struct file *file, poll_table *wait)
+{
+    struct fib_file *ff = file->private_data;
+    __poll_t mask = 0;
+    poll_wait(file, &ff->async_wait, wait);
+    spin_lock(&ff->async_lock);
+    if (!ff->async || !list_empty(&ff->async_done) || !ff->async_pending ||
+        READ_ONCE(ff->async_cur))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (ff->async_nr < FIB_ASYNC_MAX)
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    spin_unlock(&ff->async_lock);
+    return mask;
+}
+
 const struct file_operations fib_fops = {
     .owner = THIS_MODULE,
     .read = fib_read,
@@ -304,13 +1551,50 @@ const struct file_operations fib_fops = {
     .open = fib_open,
     .release = fib_release,
     .llseek = fib_device_lseek,
+    .unlocked_ioctl = fib_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .mmap = fib_mmap,
+    .poll = fib_poll,
 };
 
 static int __init init_fib_dev(void)
 {
     int rc = 0;
 
-    mutex_init(&fib_mutex);
+    rc = fib_cache_init();
+    if (rc < 0) {
+        printk(KERN_ALERT "Failed to register the cache shrinker. rc = %i", rc);
+        return rc;
+    }
+
+    rc = bn_init();
+    if (rc < 0) {
+        printk(KERN_ALERT "Failed to create the bn cache. rc = %i", rc);
+        goto failed_bn;
+    }
+
+    // the products of a doubling step are long running and cpu bound
+    fib_wq = alloc_workqueue("fibdrv", WQ_UNBOUND, 0);
+    if (!fib_wq) {
+        printk(KERN_ALERT "Failed to allocate the workqueue");
+        rc = -ENOMEM;
+        goto failed_wq;
+    }
+
+    rc = ntt_init();
+    if (rc < 0) {
+        printk(KERN_ALERT "Failed to create the ntt workers. rc = %i", rc);
+        goto failed_ntt;
+    }
+
+    // submissions of async mode, kept apart from fib_wq which they wait on
+    fib_async_wq =
+        alloc_workqueue("fibdrv_async", WQ_UNBOUND, FIB_ASYNC_ACTIVE);
+    if (!fib_async_wq) {
+        printk(KERN_ALERT "Failed to allocate the async workqueue");
+        rc = -ENOMEM;
+        goto failed_async_wq;
+    }
 
     // Let's register the device
     // This will dynamically allocate the major number
@@ -320,7 +1604,7 @@ static int __init init_fib_dev(void)
         printk(KERN_ALERT
                "Failed to register the fibonacci char device. rc = %i",
                rc);
-        return rc;
+        goto failed_chrdev;
     }
 
     fib_cdev = cdev_alloc();
@@ -346,11 +1630,16 @@ static int __init init_fib_dev(void)
         goto failed_class_create;
     }
 
-    if (!device_create(fib_class, NULL, fib_dev, NULL, DEV_FIBONACCI_NAME)) {
+    if (!device_create_with_groups(fib_class, NULL, fib_dev, NULL,
+                                   fib_stats_groups, DEV_FIBONACCI_NAME)) {
         printk(KERN_ALERT "Failed to create device");
         rc = -4;
         goto failed_device_create;
     }
+    // debugfs is optional, its files are left out if it fails
+    fib_debugfs = debugfs_create_dir("fibonacci", NULL);
+    fib_stats_init(fib_debugfs);
+    fib_bench_init(fib_debugfs);
     return rc;
 failed_device_create:
     class_destroy(fib_class);
@@ -358,16 +1647,32 @@ failed_class_create:
     cdev_del(fib_cdev);
 failed_cdev:
     unregister_chrdev_region(fib_dev, 1);
+failed_chrdev:
+    destroy_workqueue(fib_async_wq);
+failed_async_wq:
+    ntt_exit();
+failed_ntt:
+    destroy_workqueue(fib_wq);
+failed_wq:
+    bn_exit();
+failed_bn:
+    fib_cache_exit();
     return rc;
 }
 
 static void __exit exit_fib_dev(void)
 {
-    mutex_destroy(&fib_mutex);
+    // waits for a running benchmark to finish
+    debugfs_remove_recursive(fib_debugfs);
     device_destroy(fib_class, fib_dev);
     class_destroy(fib_class);
     cdev_del(fib_cdev);
     unregister_chrdev_region(fib_dev, 1);
+    destroy_workqueue(fib_async_wq);
+    ntt_exit();
+    destroy_workqueue(fib_wq);
+    bn_exit();
+    fib_cache_exit();
 }
 
 module_init(init_fib_dev);
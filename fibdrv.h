@@ -0,0 +1,164 @@
+#ifndef __FIBDRV_H_
+#define __FIBDRV_H_
+
+/*
+ * Interface of /dev/fibonacci shared with the user space programs
+ * Seek to k and read to get fib(k) as little endian bytes, a read returns
+ * at most the requested number of bytes and 0 once the whole number has
+ * been read
+ * To map fib(k) instead, seek to k, get its number of limbs with
+ * FIB_IOC_LIMBS and mmap that many 64-bit limbs PROT_READ and MAP_SHARED
+ * Many numbers can be calculated in one call with FIB_IOC_BATCH
+ * In range mode, set with FIB_IOC_RANGE or by writing "range <first> <last>",
+ * reads return fib(first) to fib(last) as one stream of records, each the
+ * number of bytes of fib(k) as a 64-bit number followed by those bytes,
+ * until the next seek
+ * fib(k) modulo a number, for any 64-bit k, is calculated with FIB_IOC_MOD
+ * and its leading digits, for k below 2^62, with FIB_IOC_LEAD
+ * In async mode, entered by submitting k with FIB_IOC_SUBMIT or by writing
+ * "submit <k>", fib(k) is calculated in the background and several
+ * submissions may be outstanding. The file polls readable once a result is
+ * ready, and reads return the results in the order they complete, each a
+ * struct fib_record followed by the bytes of fib(k), until the next seek.
+ * A read waits for the next result unless the file is non-blocking, and
+ * returns 0 once nothing is outstanding.
+ * The number of results of each mode, the bytes copied and the failed
+ * calculations are found in /sys/class/fibonacci/fibonacci/stats, and the
+ * latency histograms of the results by mode and size in the latency
+ * directory of the fibonacci directory of debugfs. Writing to the reset
+ * file of stats clears them all.
+ * Writing to bench in the fibonacci directory of debugfs times the bignum
+ * primitives for the numbers of limbs listed in sizes, with the runs set by
+ * warmup and reps, and reading it returns the median and the minimum number
+ * of cycles of each primitive and size, or - where the size is beyond the
+ * range of the primitive. A run in which a primitive fails keeps no results.
+ */
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define FIB_IOC_MAGIC 'f'
+
+/* nanoseconds spent on the last calculation of this file */
+#define FIB_IOC_TIME _IOR(FIB_IOC_MAGIC, 1, __u64)
+
+/* calculate fib at the current offset for mmap, returns its number of limbs */
+#define FIB_IOC_LIMBS _IOR(FIB_IOC_MAGIC, 2, __u64)
+
+/* largest number of items in a batch */
+#define FIB_BATCH_MAX (1 << 16)
+
+/**
+ * fib_batch_item - a number calculated by FIB_IOC_BATCH
+ * @k: index of the fibonacci number
+ * @offset: position of the result in the buffer of the batch
+ * @len: room for the result in the buffer, the rest is left out
+ * @size: set to the number of bytes of fib(k), larger than len if truncated
+ * @ns: set to the nanoseconds spent on fib(k)
+ */
+struct fib_batch_item {
+    __u64 k;
+    __u64 offset;
+    __u64 len;
+    __u64 size;
+    __u64 ns;
+};
+
+/**
+ * fib_batch - argument of FIB_IOC_BATCH
+ * @items: address of an array of count items
+ * @buf: address of the buffer the results are written to, as little endian
+ * bytes
+ * @count: number of items, at most FIB_BATCH_MAX
+ * @pad: must be 0
+ */
+struct fib_batch {
+    __u64 items;
+    __u64 buf;
+    __u32 count;
+    __u32 pad;
+};
+
+/* calculate every item of a batch, in any order, with one call */
+#define FIB_IOC_BATCH _IOWR(FIB_IOC_MAGIC, 3, struct fib_batch)
+
+/**
+ * fib_range - argument of FIB_IOC_RANGE
+ * @first: index of the first record
+ * @last: index of the last record
+ */
+struct fib_range {
+    __u64 first;
+    __u64 last;
+};
+
+/* switch the file to range mode */
+#define FIB_IOC_RANGE _IOW(FIB_IOC_MAGIC, 4, struct fib_range)
+
+/* largest number of limbs of a modulus */
+#define FIB_MOD_LIMBS 64
+
+/**
+ * fib_modulo - argument of FIB_IOC_MOD
+ * @k: index of the fibonacci number
+ * @m: address of the limbs of the modulus, least significant first, or 0
+ * for 2^(64 * limbs)
+ * @res: address of limbs receiving fib(k) mod m
+ * @limbs: number of limbs of the modulus and the result, at most
+ * FIB_MOD_LIMBS
+ * @pad: must be 0
+ */
+struct fib_modulo {
+    __u64 k;
+    __u64 m;
+    __u64 res;
+    __u32 limbs;
+    __u32 pad;
+};
+
+/* calculate fib(k) mod m */
+#define FIB_IOC_MOD _IOW(FIB_IOC_MAGIC, 5, struct fib_modulo)
+
+/**
+ * fib_lead - argument of FIB_IOC_LEAD
+ * @k: index of the fibonacci number, below 2^62
+ * @base: 2 or 10
+ * @digits: number of leading digits, at most 64 for base 2 and 19 for base
+ * 10
+ * @lead: set to the leading digits, all of them if fib(k) has fewer
+ * @exp: set to the number of digits of fib(k) minus one
+ */
+struct fib_lead {
+    __u64 k;
+    __u32 base;
+    __u32 digits;
+    __u64 lead;
+    __u64 exp;
+};
+
+/*
+ * leading digits of fib(k) without calculating the rest, fails with ERANGE
+ * in the rare case the digits cannot be told apart from their neighbours
+ */
+#define FIB_IOC_LEAD _IOWR(FIB_IOC_MAGIC, 6, struct fib_lead)
+
+/* largest number of submissions of a file not read yet */
+#define FIB_ASYNC_MAX 256
+
+/*
+ * calculate fib(k) in the background, fails with EAGAIN if FIB_ASYNC_MAX
+ * submissions are outstanding
+ */
+#define FIB_IOC_SUBMIT _IOW(FIB_IOC_MAGIC, 7, __u64)
+
+/**
+ * fib_record - header of a result read in async mode
+ * @k: index of the fibonacci number
+ * @size: number of bytes of fib(k) that follow, 0 if the calculation failed
+ */
+struct fib_record {
+    __u64 k;
+    __u64 size;
+};
+
+#endif
@@ -0,0 +1,185 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM fibdrv
+
+#ifndef __FIBDRV_TRACE_CLOCK_H_
+#define __FIBDRV_TRACE_CLOCK_H_
+
+#include <linux/ktime.h>
+
+/**
+ * fib_mul_alg - algorithm of a product traced by fib_mul
+ * @FIB_MUL_LIMB: schoolbook, karatsuba or toom3, chosen by the size
+ * @FIB_MUL_CRT: transforms over the NTT_PRIMES primes
+ * @FIB_MUL_STRASSEN: transforms over a single prime
+ * @FIB_MUL_DOUBLING: both products of a doubling step from one pair of
+ * transforms
+ */
+enum fib_mul_alg {
+    FIB_MUL_LIMB,
+    FIB_MUL_CRT,
+    FIB_MUL_STRASSEN,
+    FIB_MUL_DOUBLING,
+};
+
+/**
+ * fib_trace_start: start time of a phase whose duration is traced
+ * The clock is only read while the event is enabled
+ * @enabled: trace_<event>_enabled() of the event ending the phase
+ * @return: the start time, 0 if the event is disabled
+ */
+static inline u64 fib_trace_start(bool enabled)
+{
+    return enabled ? ktime_get_ns() : 0;
+}
+
+/**
+ * fib_trace_ns: duration of a phase started by fib_trace_start
+ * @start: the start time
+ * @return: nanoseconds since start, 0 if the event was enabled meanwhile
+ */
+static inline u64 fib_trace_ns(u64 start)
+{
+    return start ? ktime_get_ns() - start : 0;
+}
+
+#endif
+
+#if !defined(__FIBDRV_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define __FIBDRV_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+// the events keep the layout of the kernel trace headers
+// clang-format off
+TRACE_DEFINE_ENUM(FIB_MUL_LIMB);
+TRACE_DEFINE_ENUM(FIB_MUL_CRT);
+TRACE_DEFINE_ENUM(FIB_MUL_STRASSEN);
+TRACE_DEFINE_ENUM(FIB_MUL_DOUBLING);
+
+TRACE_EVENT(fib_request_start,
+    TP_PROTO(long long k, u8 mode),
+    TP_ARGS(k, mode),
+    TP_STRUCT__entry(
+        __field(long long, k)
+        __field(u8, mode)
+    ),
+    TP_fast_assign(
+        __entry->k = k;
+        __entry->mode = mode;
+    ),
+    TP_printk("k=%lld mode=%s", __entry->k,
+              __entry->mode ? "fast" : "strassen")
+);
+
+TRACE_EVENT(fib_request_end,
+    TP_PROTO(long long k, long ret),
+    TP_ARGS(k, ret),
+    TP_STRUCT__entry(
+        __field(long long, k)
+        __field(long, ret)
+    ),
+    TP_fast_assign(
+        __entry->k = k;
+        __entry->ret = ret;
+    ),
+    TP_printk("k=%lld ret=%ld", __entry->k, __entry->ret)
+);
+
+TRACE_EVENT(fib_doubling_step,
+    TP_PROTO(long long n, size_t limbs, bool par, u64 ns),
+    TP_ARGS(n, limbs, par, ns),
+    TP_STRUCT__entry(
+        __field(long long, n)
+        __field(size_t, limbs)
+        __field(bool, par)
+        __field(u64, ns)
+    ),
+    TP_fast_assign(
+        __entry->n = n;
+        __entry->limbs = limbs;
+        __entry->par = par;
+        __entry->ns = ns;
+    ),
+    TP_printk("n=%lld limbs=%zu par=%d ns=%llu", __entry->n,
+              __entry->limbs, __entry->par, __entry->ns)
+);
+
+TRACE_EVENT(fib_doubling_mem,
+    TP_PROTO(long long k, long allocs, size_t bytes),
+    TP_ARGS(k, allocs, bytes),
+    TP_STRUCT__entry(
+        __field(long long, k)
+        __field(long, allocs)
+        __field(size_t, bytes)
+    ),
+    TP_fast_assign(
+        __entry->k = k;
+        __entry->allocs = allocs;
+        __entry->bytes = bytes;
+    ),
+    TP_printk("k=%lld allocs=%ld bytes=%zu", __entry->k, __entry->allocs,
+              __entry->bytes)
+);
+
+TRACE_EVENT(fib_mul,
+    TP_PROTO(int alg, size_t a_limbs, size_t b_limbs, u64 ns),
+    TP_ARGS(alg, a_limbs, b_limbs, ns),
+    TP_STRUCT__entry(
+        __field(int, alg)
+        __field(size_t, a_limbs)
+        __field(size_t, b_limbs)
+        __field(u64, ns)
+    ),
+    TP_fast_assign(
+        __entry->alg = alg;
+        __entry->a_limbs = a_limbs;
+        __entry->b_limbs = b_limbs;
+        __entry->ns = ns;
+    ),
+    TP_printk("alg=%s a=%zu b=%zu ns=%llu",
+              __print_symbolic(__entry->alg,
+                               { FIB_MUL_LIMB, "limb" },
+                               { FIB_MUL_CRT, "crt" },
+                               { FIB_MUL_STRASSEN, "strassen" },
+                               { FIB_MUL_DOUBLING, "doubling" }),
+              __entry->a_limbs, __entry->b_limbs, __entry->ns)
+);
+
+TRACE_EVENT(fib_ntt,
+    TP_PROTO(int n, bool inverse, u64 ns),
+    TP_ARGS(n, inverse, ns),
+    TP_STRUCT__entry(
+        __field(int, n)
+        __field(bool, inverse)
+        __field(u64, ns)
+    ),
+    TP_fast_assign(
+        __entry->n = n;
+        __entry->inverse = inverse;
+        __entry->ns = ns;
+    ),
+    TP_printk("n=%d inverse=%d ns=%llu", __entry->n, __entry->inverse,
+              __entry->ns)
+);
+
+TRACE_EVENT(fib_copy,
+    TP_PROTO(size_t bytes, u64 ns),
+    TP_ARGS(bytes, ns),
+    TP_STRUCT__entry(
+        __field(size_t, bytes)
+        __field(u64, ns)
+    ),
+    TP_fast_assign(
+        __entry->bytes = bytes;
+        __entry->ns = ns;
+    ),
+    TP_printk("bytes=%zu ns=%llu", __entry->bytes, __entry->ns)
+);
+// clang-format on
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE fibdrv_trace
+#include <trace/define_trace.h>
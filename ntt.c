@@ -0,0 +1,290 @@
+#include <linux/cpu.h>
+#include <linux/cpumask.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include "ntt.h"
+
+static unsigned int ntt_threads;
+module_param(ntt_threads, uint, 0644);
+MODULE_PARM_DESC(ntt_threads,
+                 "Threads of a long transform, 0 for one per online cpu");
+
+static struct workqueue_struct *ntt_wq;
+
+static const struct {
+    uint64_t p;
+    uint64_t g;
+} ntt_primes[NTT_PRIMES] = {
+    {NTT_P0, rou},
+    {NTT_P1, 31},
+    {NTT_P2, 3},
+};
+
+static struct ntt_table *ntt_cache[NTT_PRIMES][NTT_MAX_LOG + 1];
+static DEFINE_MUTEX(ntt_mutex);
+
+static void ntt_table_free(struct ntt_table *tbl)
+{
+    if (!tbl)
+        return;
+    kvfree(tbl->fwd);
+    kvfree(tbl->inv);
+    kvfree(tbl->rev);
+    kfree(tbl);
+}
+
+/**
+ * ntt_table_build - compute the table for transforms of 2^log points
+ * Only runs once per size, so plain modular arithmetic is used here
+ * @log: log2 of the length of the transform
+ * @p: prime number
+ * @g: primitive root of p
+ * @return: the new table, NULL if failed to allocate memory
+ */
+static struct ntt_table *ntt_table_build(int log, uint64_t p, uint64_t g)
+{
+    int n = 1 << log;
+    struct ntt_table *tbl = kzalloc(sizeof(struct ntt_table), GFP_KERNEL);
+    if (!tbl)
+        return NULL;
+    tbl->n = n;
+    tbl->p = p;
+    tbl->pinv = mont_pinv(p);
+    tbl->fwd = kvmalloc_array(n, sizeof(uint64_t), GFP_KERNEL);
+    tbl->inv = kvmalloc_array(n, sizeof(uint64_t), GFP_KERNEL);
+    tbl->rev = kvmalloc_array(n, sizeof(uint32_t), GFP_KERNEL);
+    if (!tbl->fwd || !tbl->inv || !tbl->rev) {
+        printk(KERN_ERR "ntt_table_build: memory allocation failed\n");
+        ntt_table_free(tbl);
+        return NULL;
+    }
+    const uint32_t pinv = tbl->pinv;
+    tbl->rev[0] = 0;
+    for (int i = 1; i < n; i++)
+        tbl->rev[i] = tbl->rev[i >> 1] >> 1 | (i & 1) << (log - 1);
+    for (int half = 1; half < n; half <<= 1) {
+        uint64_t wm = fast_pow(g, (p - 1) / (2 * half), p);
+        // modular inverse
+        uint64_t wm_inv = fast_pow(wm, p - 2, p);
+        uint64_t w = 1, w_inv = 1;
+        for (int j = 0; j < half; j++) {
+            tbl->fwd[half - 1 + j] = to_mont(w, p, pinv);
+            tbl->inv[half - 1 + j] = to_mont(w_inv, p, pinv);
+            w = w * wm % p;
+            w_inv = w_inv * wm_inv % p;
+        }
+    }
+    // inv by Fermat's little theorem
+    tbl->n_inv = to_mont(fast_pow(n, p - 2, p), p, pinv);
+    return tbl;
+}
+
+const struct ntt_table *ntt_table_get(int n, int prime)
+{
+    int log = ilog2(n);
+    if (unlikely(log > NTT_MAX_LOG || prime >= NTT_PRIMES)) {
+        printk(KERN_ERR "ntt_table_get: size %d is too large\n", n);
+        return NULL;
+    }
+    // tables are never modified once published
+    struct ntt_table *tbl = smp_load_acquire(&ntt_cache[prime][log]);
+    if (likely(tbl))
+        return tbl;
+    mutex_lock(&ntt_mutex);
+    tbl = ntt_cache[prime][log];
+    if (!tbl) {
+        tbl = ntt_table_build(log, ntt_primes[prime].p, ntt_primes[prime].g);
+        if (tbl)
+            smp_store_release(&ntt_cache[prime][log], tbl);
+    }
+    mutex_unlock(&ntt_mutex);
+    return tbl;
+}
+
+void ntt_table_free_all(void)
+{
+    mutex_lock(&ntt_mutex);
+    for (int i = 0; i < NTT_PRIMES; i++) {
+        for (int j = 0; j <= NTT_MAX_LOG; j++) {
+            ntt_table_free(ntt_cache[i][j]);
+            ntt_cache[i][j] = NULL;
+        }
+    }
+    mutex_unlock(&ntt_mutex);
+}
+
+/**
+ * ntt_part - a part of a job run by an ntt worker
+ * @work: item queued on ntt_wq
+ * @fn: function of the part
+ * @arg: argument shared by the parts
+ * @i: index of the part
+ * @nr: number of parts
+ */
+struct ntt_part {
+    struct work_struct work;
+    ntt_par_fn fn;
+    void *arg;
+    int i;
+    int nr;
+};
+
+static void ntt_part_work(struct work_struct *work)
+{
+    struct ntt_part *part = container_of(work, struct ntt_part, work);
+    part->fn(part->arg, part->i, part->nr);
+}
+
+int ntt_par_parts(int n)
+{
+    unsigned int nr = READ_ONCE(ntt_threads);
+    if (!ntt_wq || n < 1 << NTT_PAR_MIN_LOG)
+        return 1;
+    if (!nr)
+        nr = num_online_cpus();
+    // parts of a power of 2 divide every transform evenly
+    return rounddown_pow_of_two(min_t(unsigned int, nr, NTT_PAR_MAX));
+}
+
+void ntt_par_run(ntt_par_fn fn, void *arg, int nr)
+{
+    struct ntt_part parts[NTT_PAR_MAX];
+    if (nr <= 1) {
+        fn(arg, 0, 1);
+        return;
+    }
+    // the cpus the parts are bound to stay online until they are done
+    cpus_read_lock();
+    int cpu = raw_smp_processor_id();
+    for (int i = 1; i < nr; i++) {
+        cpu = cpumask_next(cpu, cpu_online_mask);
+        if (cpu >= nr_cpu_ids)
+            cpu = cpumask_first(cpu_online_mask);
+        parts[i].fn = fn;
+        parts[i].arg = arg;
+        parts[i].i = i;
+        parts[i].nr = nr;
+        INIT_WORK_ONSTACK(&parts[i].work, ntt_part_work);
+        queue_work_on(cpu, ntt_wq, &parts[i].work);
+    }
+    fn(arg, 0, nr);
+    for (int i = 1; i < nr; i++) {
+        flush_work(&parts[i].work);
+        destroy_work_on_stack(&parts[i].work);
+    }
+    cpus_read_unlock();
+}
+
+/**
+ * ntt_par_arg - a step of ntt_par shared by its parts
+ * @a: first array
+ * @b: second array of the pointwise products
+ * @tbl: table of the transform
+ * @tw: twiddle factors of the transform
+ * @op: operation of ntt_par
+ * @step: step of the transform, see ntt_par_step
+ * @half: span of the butterflies of a NTT_STEP_STAGE
+ */
+struct ntt_par_arg {
+    uint64_t *a;
+    uint64_t *b;
+    const struct ntt_table *tbl;
+    const uint64_t *tw;
+    enum ntt_op op;
+    int step;
+    int half;
+};
+
+enum {
+    NTT_STEP_BITREV,
+    NTT_STEP_BLOCK,
+    NTT_STEP_STAGE,
+    NTT_STEP_FINAL,
+};
+
+/*
+ * Every part owns n / nr consecutive coefficients. The stages with a span
+ * below that stay within the block of a part, while each of the remaining
+ * log2(nr) stages is one run of n / 2nr butterflies per part. Every
+ * coefficient goes through the same operations in the same order as in
+ * __ntt, so the result does not depend on nr.
+ */
+static void ntt_par_step(void *arg, int i, int nr)
+{
+    struct ntt_par_arg *par = arg;
+    const struct ntt_table *tbl = par->tbl;
+    int len = tbl->n / nr, from = i * len, to = from + len;
+    uint64_t *a = par->a;
+    switch (par->step) {
+    case NTT_STEP_BITREV:
+        ntt_bitrev(a, tbl, from, to);
+        break;
+    case NTT_STEP_BLOCK:
+        ntt_stages(a + from, len, tbl, par->tw);
+        break;
+    case NTT_STEP_STAGE: {
+        int half = par->half, run = len / 2, first = i * run;
+        // a run never crosses a group of butterflies since half >= run
+        uint64_t *x = a + first / half * 2 * half + first % half;
+        ntt_butterflies(x, x + half, par->tw + half - 1 + first % half, run,
+                        tbl);
+        bn_resched(run);
+        break;
+    }
+    case NTT_STEP_FINAL:
+        if (par->op == NTT_FWD)
+            ntt_reduce(a, tbl, from, to);
+        else if (par->op == NTT_INV)
+            intt_scale(a, tbl, from, to);
+        else if (par->op == NTT_MUL)
+            __ntt_pointwise(a, par->b, tbl, from, to);
+        else
+            __ntt_pointwise_doubling(a, par->b, tbl, from, to);
+        break;
+    }
+}
+
+void ntt_par(uint64_t *a,
+             uint64_t *b,
+             const struct ntt_table *tbl,
+             int nr,
+             enum ntt_op op)
+{
+    struct ntt_par_arg par = {
+        .a = a,
+        .b = b,
+        .tbl = tbl,
+        .tw = op == NTT_INV ? tbl->inv : tbl->fwd,
+        .op = op,
+    };
+    if (op == NTT_FWD || op == NTT_INV) {
+        par.step = NTT_STEP_BITREV;
+        ntt_par_run(ntt_par_step, &par, nr);
+        par.step = NTT_STEP_BLOCK;
+        ntt_par_run(ntt_par_step, &par, nr);
+        par.step = NTT_STEP_STAGE;
+        for (par.half = tbl->n / nr; par.half < tbl->n; par.half <<= 1)
+            ntt_par_run(ntt_par_step, &par, nr);
+    }
+    par.step = NTT_STEP_FINAL;
+    ntt_par_run(ntt_par_step, &par, nr);
+}
+
+int ntt_init(void)
+{
+    // bound to a cpu each, so the parts of a transform run side by side, and
+    // cpu intensive, so that a long part neither holds back the other work
+    // items of its cpu nor is held back by them
+    ntt_wq = alloc_workqueue("fibdrv_ntt", WQ_CPU_INTENSIVE, 0);
+    return ntt_wq ? 0 : -ENOMEM;
+}
+
+void ntt_exit(void)
+{
+    destroy_workqueue(ntt_wq);
+    ntt_wq = NULL;
+    ntt_table_free_all();
+}
@@ -1,29 +1,65 @@
 #ifndef __NTT_H__
 #define __NTT_H__
 #include <linux/slab.h>
+#include "bn.h"
+#include "fibdrv_trace.h"
 
 #define CLZ(x) __builtin_clzll(x)
 
 // the modulo could be altered
 #define mod 1107296257
 #define rou 10
+// mod = 33 * 2^25 + 1, the longest transform has 2^25 points
+#define NTT_MAX_LOG 25
+
+// primes of the multi-modular transform, the first one is mod
+// 2013265921 = 15 * 2^27 + 1, 469762049 = 7 * 2^26 + 1
+#define NTT_PRIMES 3
+#define NTT_P0 1107296257ULL
+#define NTT_P1 2013265921ULL
+#define NTT_P2 469762049ULL
+
+/**
+ * ntt_table - precomputed data for transforms of one size and prime
+ * Twiddle factors are stored in montgomery form, the ones of the stage
+ * with butterflies of span h start at offset h - 1
+ * @n: length of the transform
+ * @p: prime number of the transform
+ * @pinv: mont_pinv(p)
+ * @fwd: twiddle factors of ntt
+ * @inv: twiddle factors of intt
+ * @rev: bit-reversal permutation
+ * @n_inv: n^-1 mod p in montgomery form
+ */
+struct ntt_table {
+    int n;
+    uint64_t p;
+    uint32_t pinv;
+    uint64_t *fwd;
+    uint64_t *inv;
+    uint32_t *rev;
+    uint64_t n_inv;
+};
+
+/**
+ * ntt_table_get - get the table for transforms of length n modulo a prime
+ * The table is built on first use and kept until ntt_table_free_all
+ * @n: length of the transform, a power of 2
+ * @prime: index of the prime, 0 for mod
+ * @return: the table, NULL if failed to allocate memory
+ */
+const struct ntt_table *ntt_table_get(int n, int prime);
+
+/**
+ * ntt_table_free_all - free every cached table
+ */
+void ntt_table_free_all(void);
 
 static inline int nextpow2(uint64_t x)
 {
     return 1 << (64 - CLZ(x - 1));
 }
 
-static inline int reverse_bits(int x, int n)
-{
-    int result = 0;
-    for (int i = 0; i < n; i++) {
-        result <<= 1;
-        result |= (x & 1);
-        x >>= 1;
-    }
-    return result;
-}
-
 static inline uint64_t fast_pow(uint64_t x, uint64_t n, uint64_t p)
 {
     uint64_t result = 1;
@@ -38,67 +74,340 @@ static inline uint64_t fast_pow(uint64_t x, uint64_t n, uint64_t p)
 }
 
 /**
- * ntt - number theoretic transform
+ * mont_pinv - constant for montgomery reduction with R = 2^32
+ * @p: odd prime number, p < 2^31
+ * @return: -p^-1 mod 2^32
+ */
+static inline uint32_t mont_pinv(uint32_t p)
+{
+    uint32_t inv = p;
+    // newton iteration doubles the number of correct bits each time
+    for (int i = 0; i < 4; i++)
+        inv *= 2 - p * inv;
+    return -inv;
+}
+
+/**
+ * mont_reduce - montgomery reduction without division
+ * @t: value to be reduced, t < p * 2^32
+ * @p: prime number, p < 2^31
+ * @pinv: mont_pinv(p)
+ * @return: t * 2^-32 mod p, lazily reduced to [0, 2p)
+ */
+static inline uint64_t mont_reduce(uint64_t t, uint64_t p, uint32_t pinv)
+{
+    uint32_t m = (uint32_t) t * pinv;
+    return (t + (uint64_t) m * p) >> 32;
+}
+
+/**
+ * to_mont - convert x to montgomery form
+ * @x: value to be converted, x < p
+ * @p: prime number, p < 2^31
+ * @pinv: mont_pinv(p)
+ * @return: x * 2^32 mod p
+ */
+static inline uint64_t to_mont(uint64_t x, uint64_t p, uint32_t pinv)
+{
+    uint64_t r2 = (U64_MAX % p + 1) % p;
+    uint64_t val = mont_reduce(x * r2, p, pinv);
+    return val >= p ? val - p : val;
+}
+
+// transforms of at least 2^NTT_PAR_MIN_LOG points are split between the
+// ntt workers, at most NTT_PAR_MAX parts at once
+#define NTT_PAR_MIN_LOG 16
+#define NTT_PAR_MAX 16
+
+/**
+ * ntt_par_fn - a part of a job split by ntt_par_run
+ * @arg: argument shared by the parts
+ * @i: index of the part
+ * @nr: number of parts
+ */
+typedef void (*ntt_par_fn)(void *arg, int i, int nr);
+
+/**
+ * ntt_par_parts - number of parts to split a transform into
+ * @n: length of the transform
+ * @return: a power of 2 up to ntt_threads, 1 if the transform should run on
+ * the caller alone
+ */
+int ntt_par_parts(int n);
+
+/**
+ * ntt_par_run - run the parts of a job on the ntt workers and wait for them
+ * Part i runs on the i-th online cpu after the caller, part 0 on the caller
+ * @fn: function of the parts
+ * @arg: argument of fn
+ * @nr: number of parts, at most NTT_PAR_MAX
+ */
+void ntt_par_run(ntt_par_fn fn, void *arg, int nr);
+
+// steps of a transform that ntt_par splits between the workers
+enum ntt_op {
+    NTT_FWD,
+    NTT_INV,
+    NTT_MUL,
+    NTT_DOUBLING,
+};
+
+/**
+ * ntt_par - ntt, intt, ntt_pointwise or ntt_pointwise_doubling split into
+ * parts, the result is the same as the one of the caller alone
+ * @a: first array, stores the result
+ * @b: second array of the pointwise products, NULL for the transforms
+ * @tbl: table of the transform
+ * @nr: ntt_par_parts(tbl->n)
+ * @op: step to be run
+ */
+void ntt_par(uint64_t *a,
+             uint64_t *b,
+             const struct ntt_table *tbl,
+             int nr,
+             enum ntt_op op);
+
+/**
+ * ntt_init - create the ntt workers
+ * @return: 0 on success, -ENOMEM if failed to allocate memory
+ */
+int ntt_init(void);
+
+/**
+ * ntt_exit - destroy the ntt workers and free every cached table
+ */
+void ntt_exit(void);
+
+// short transforms are never split, which spares them the call
+static inline int ntt_parts(int n)
+{
+    return n >= 1 << NTT_PAR_MIN_LOG ? ntt_par_parts(n) : 1;
+}
+
+static inline void __ntt_pointwise(uint64_t *a,
+                                   const uint64_t *b,
+                                   const struct ntt_table *tbl,
+                                   int from,
+                                   int to)
+{
+    const uint64_t p = tbl->p;
+    const uint32_t pinv = tbl->pinv;
+    uint64_t r2 = (U64_MAX % p + 1) % p;
+    for (int i = from; i < to; i++)
+        a[i] = mont_reduce(mont_reduce(a[i] * b[i], p, pinv) * r2, p, pinv);
+    bn_resched(to - from);
+}
+
+/**
+ * ntt_pointwise - multiply two transformed arrays element by element
+ * The second reduction by 2^64 mod p cancels the factor of 2^-32 left by
+ * the first one, the product is lazily reduced to [0, 2p)
+ * @a: first array, stores the result
+ * @b: second array
+ * @tbl: table of the transform
+ */
+static inline void ntt_pointwise(uint64_t *a,
+                                 uint64_t *b,
+                                 const struct ntt_table *tbl)
+{
+    int nr = ntt_parts(tbl->n);
+    if (nr > 1)
+        ntt_par(a, b, tbl, nr, NTT_MUL);
+    else
+        __ntt_pointwise(a, b, tbl, 0, tbl->n);
+}
+
+static inline void __ntt_pointwise_doubling(uint64_t *a,
+                                            uint64_t *b,
+                                            const struct ntt_table *tbl,
+                                            int from,
+                                            int to)
+{
+    const uint64_t p = tbl->p, p2 = 2 * p;
+    const uint32_t pinv = tbl->pinv;
+    uint64_t r2 = (U64_MAX % p + 1) % p;
+    for (int i = from; i < to; i++) {
+        uint64_t x = a[i] >= p ? a[i] - p : a[i];
+        uint64_t y = b[i] >= p ? b[i] - p : b[i];
+        uint64_t s = mont_reduce(x * x, p, pinv) + mont_reduce(y * y, p, pinv);
+        uint64_t t = 2 * x + y;
+        s = s >= p2 ? s - p2 : s;
+        t = t >= p2 ? t - p2 : t;
+        a[i] = mont_reduce(s * r2, p, pinv);
+        b[i] = mont_reduce(mont_reduce(y * t, p, pinv) * r2, p, pinv);
+    }
+    bn_resched(4 * (to - from));
+}
+
+/**
+ * ntt_pointwise_doubling - both products of a doubling step in one pass
+ * a = a^2 + b^2, b = b * (2a + b), element by element
+ * Each sum is brought back below 2p before the second reduction, the
+ * results are lazily reduced to [0, 2p)
+ * @a: transform of fib(n), stores the transform of fib(2n+1)
+ * @b: transform of fib(n+1), stores the transform of fib(2n+2)
+ * @tbl: table of the transform
+ */
+static inline void ntt_pointwise_doubling(uint64_t *a,
+                                          uint64_t *b,
+                                          const struct ntt_table *tbl)
+{
+    int nr = ntt_parts(tbl->n);
+    if (nr > 1)
+        ntt_par(a, b, tbl, nr, NTT_DOUBLING);
+    else
+        __ntt_pointwise_doubling(a, b, tbl, 0, tbl->n);
+}
+
+/**
+ * ntt_bitrev - bit-reversal permutation of a part of the coefficients
+ * Only the pairs whose lower index is in [from, to) are swapped, so the
+ * parts of a permutation are independent
  * @a: array of coefficients
- * @n: length of a
- * @p: prime number
- * @g: primitive root of p
- */
-static inline void ntt(uint64_t *a, int n, uint64_t p, uint64_t g)
-{
-    uint64_t len = 64 - CLZ(n - 1);
-    for (int i = 0; i < n; i++) {
-        if (i < reverse_bits(i, len)) {
-            a[reverse_bits(i, len)] ^= a[i];
-            a[i] ^= a[reverse_bits(i, len)];
-            a[reverse_bits(i, len)] ^= a[i];
+ * @tbl: table of the transform
+ * @from: first index of the part
+ * @to: end of the part
+ */
+static inline void ntt_bitrev(uint64_t *a,
+                              const struct ntt_table *tbl,
+                              int from,
+                              int to)
+{
+    for (int i = from; i < to; i++) {
+        uint32_t j = tbl->rev[i];
+        if (i < j) {
+            uint64_t tmp = a[i];
+            a[i] = a[j];
+            a[j] = tmp;
         }
     }
-    for (int m = 2; m <= n; m <<= 1) {
-        uint64_t wm = fast_pow(g, (p - 1) / m, p);
-        for (int k = 0; k < n; k += m) {
-            uint64_t w = 1;
-            for (uint64_t j = 0; j < m / 2; j++) {
-                uint64_t t = w * a[k + j + m / 2] % p;
-                uint64_t u = a[k + j];
-                a[k + j] = (u + t) % p;
-                a[k + j + m / 2] = (u - t + p) % p;
-                w = w * wm % p;
-            }
-        }
+    bn_resched(to - from);
+}
+
+/**
+ * ntt_butterflies - a run of butterflies of the same stage
+ * @x: first coefficients of the butterflies
+ * @y: second coefficients, one span after x
+ * @w: twiddle factors of the butterflies
+ * @len: number of butterflies
+ * @tbl: table of the transform
+ */
+static inline void ntt_butterflies(uint64_t *x,
+                                   uint64_t *y,
+                                   const uint64_t *w,
+                                   int len,
+                                   const struct ntt_table *tbl)
+{
+    const uint64_t p = tbl->p, p2 = 2 * p;
+    const uint32_t pinv = tbl->pinv;
+    for (int j = 0; j < len; j++) {
+        uint64_t t = mont_reduce(y[j] * w[j], p, pinv);
+        uint64_t u = x[j] + t;
+        t = x[j] + p2 - t;
+        x[j] = u >= p2 ? u - p2 : u;
+        y[j] = t >= p2 ? t - p2 : t;
     }
 }
 
-static inline void intt(uint64_t *a, int n, uint64_t p, uint64_t g)
+/**
+ * ntt_stages - every stage of a transform of n points in place
+ * The twiddle factors only depend on the span, so n may be a block of a
+ * longer transform whose first stages stay within the block
+ * @a: array of n coefficients, bit-reversed and each below 2p
+ * @n: number of coefficients
+ * @tbl: table of the transform
+ * @tw: twiddle factors of all stages
+ */
+static inline void ntt_stages(uint64_t *a,
+                              int n,
+                              const struct ntt_table *tbl,
+                              const uint64_t *tw)
 {
-    uint64_t len = 64 - CLZ(n - 1);
-    for (int i = 0; i < n; i++) {
-        if (i < reverse_bits(i, len)) {
-            a[reverse_bits(i, len)] ^= a[i];
-            a[i] ^= a[reverse_bits(i, len)];
-            a[reverse_bits(i, len)] ^= a[i];
-        }
+    for (int half = 1; half < n; half <<= 1) {
+        for (int k = 0; k < n; k += 2 * half)
+            ntt_butterflies(a + k, a + k + half, tw + half - 1, half, tbl);
+        bn_resched(n / 2);
     }
-    for (int m = 2; m <= n; m <<= 1) {
-        uint64_t wm = fast_pow(g, (p - 1) / m, p);
-        // modular inverse
-        wm = fast_pow(wm, p - 2, p);
-        for (int k = 0; k < n; k += m) {
-            uint64_t w = 1;
-            for (int j = 0; j < m / 2; j++) {
-                uint64_t t = w * a[k + j + m / 2] % p;
-                uint64_t u = a[k + j];
-                a[k + j] = (u + t) % p;
-                a[k + j + m / 2] = (u - t + p) % p;
-                w = w * wm % p;
-            }
-        }
+}
+
+/**
+ * __ntt - iterative radix-2 transform shared by ntt and intt
+ * Twiddle factors are kept in montgomery form, so multiplying a plain
+ * value by them gives a plain product without any division. Values are
+ * lazily reduced to [0, 2p) between the stages.
+ * @a: array of coefficients, each below 2p
+ * @tbl: table of the transform
+ * @tw: twiddle factors of all stages
+ */
+static inline void __ntt(uint64_t *a,
+                         const struct ntt_table *tbl,
+                         const uint64_t *tw)
+{
+    ntt_bitrev(a, tbl, 0, tbl->n);
+    ntt_stages(a, tbl->n, tbl, tw);
+}
+
+// bring the coefficients in [from, to) from [0, 2p) to [0, p)
+static inline void ntt_reduce(uint64_t *a,
+                              const struct ntt_table *tbl,
+                              int from,
+                              int to)
+{
+    const uint64_t p = tbl->p;
+    for (int i = from; i < to; i++)
+        a[i] = a[i] >= p ? a[i] - p : a[i];
+    bn_resched(to - from);
+}
+
+// divide the coefficients in [from, to) by n and fully reduce them
+static inline void intt_scale(uint64_t *a,
+                              const struct ntt_table *tbl,
+                              int from,
+                              int to)
+{
+    const uint64_t p = tbl->p;
+    for (int i = from; i < to; i++) {
+        uint64_t val = mont_reduce(a[i] * tbl->n_inv, p, tbl->pinv);
+        a[i] = val >= p ? val - p : val;
     }
-    // inv by Fermat's little theorem
-    uint64_t inv = fast_pow(n, p - 2, p);
-    printk(KERN_INFO "inv: %llu\n", inv);
-    for (int i = 0; i < n; i++) {
-        a[i] = a[i] * inv % p;
+    bn_resched(to - from);
+}
+
+/**
+ * ntt - number theoretic transform
+ * The result is fully reduced to [0, p)
+ * @a: array of coefficients, each below 2p
+ * @tbl: ntt_table_get(length of a)
+ */
+static inline void ntt(uint64_t *a, const struct ntt_table *tbl)
+{
+    u64 ts = fib_trace_start(trace_fib_ntt_enabled());
+    int nr = ntt_parts(tbl->n);
+    if (nr > 1) {
+        ntt_par(a, NULL, tbl, nr, NTT_FWD);
+    } else {
+        __ntt(a, tbl, tbl->fwd);
+        ntt_reduce(a, tbl, 0, tbl->n);
+    }
+    trace_fib_ntt(tbl->n, false, fib_trace_ns(ts));
+}
+
+/**
+ * intt - inverse number theoretic transform
+ * The result is fully reduced to [0, p)
+ * @a: array of coefficients, each below 2p
+ * @tbl: ntt_table_get(length of a)
+ */
+static inline void intt(uint64_t *a, const struct ntt_table *tbl)
+{
+    u64 ts = fib_trace_start(trace_fib_ntt_enabled());
+    int nr = ntt_parts(tbl->n);
+    if (nr > 1) {
+        ntt_par(a, NULL, tbl, nr, NTT_INV);
+    } else {
+        __ntt(a, tbl, tbl->inv);
+        intt_scale(a, tbl, 0, tbl->n);
     }
+    trace_fib_ntt(tbl->n, true, fib_trace_ns(ts));
 }
-#endif
\ No newline at end of file
+#endif
@@ -1,52 +1,137 @@
 #!/usr/bin/python3
 
+import argparse
+import time
+
 from bcc import BPF
+
+parser = argparse.ArgumentParser(
+    description="Break the time of fibdrv requests down by phase")
+parser.add_argument("interval", nargs="?", type=int, default=0,
+                    help="seconds between reports, 0 reports on Ctrl-C")
+args = parser.parse_args()
+
 prog = """
-#include <uapi/linux/ptrace.h>
-#include <linux/fs.h>
+// phases of a request, in the order they are reported
+enum {
+    REQUEST,
+    STEP,
+    MUL_LIMB,
+    MUL_CRT,
+    MUL_STRASSEN,
+    MUL_DOUBLING,
+    NTT,
+    INTT,
+    COPY,
+};
+
+struct total {
+    u64 count;
+    u64 ns;
+};
 
-BPF_HASH(start, u64, u64);
-BPF_HASH(args, u64, loff_t);
+BPF_HASH(start, u32, u64);
+BPF_ARRAY(totals, struct total, COPY + 1);
+BPF_ARRAY(copied, u64, 1);
+// transform lengths, so that the report can show them separately
+BPF_HASH(ntt_len, u32, struct total);
 
-int probe_handler(struct pt_regs *ctx,
-                  struct file *file,
-                  char *buf,
-                  size_t size,
-                  loff_t *offset)
+static void account(int phase, u64 ns)
+{
+    struct total *t = totals.lookup(&phase);
+    if (t) {
+        __sync_fetch_and_add(&t->count, 1);
+        __sync_fetch_and_add(&t->ns, ns);
+    }
+}
 
+TRACEPOINT_PROBE(fibdrv, fib_request_start)
 {
+    u32 pid = bpf_get_current_pid_tgid();
     u64 ts = bpf_ktime_get_ns();
-    u64 pid = bpf_get_current_pid_tgid();
-    loff_t arg = *offset;
-    
     start.update(&pid, &ts);
-    args.update(&pid, &arg);
     return 0;
 }
 
-int ret_handler(struct pt_regs *ctx)
+TRACEPOINT_PROBE(fibdrv, fib_request_end)
 {
-    u64 ts = bpf_ktime_get_ns();
-    u64 pid = bpf_get_current_pid_tgid();
+    u32 pid = bpf_get_current_pid_tgid();
     u64 *tsp = start.lookup(&pid);
-    loff_t *offset = args.lookup(&pid);
-
-    if (tsp != 0 && offset != 0) {
-        bpf_trace_printk("%lld, %llu\\n", *offset, ts - *tsp);
+    if (tsp) {
+        account(REQUEST, bpf_ktime_get_ns() - *tsp);
         start.delete(&pid);
-        args.delete(&pid);
     }
     return 0;
 }
+
+TRACEPOINT_PROBE(fibdrv, fib_doubling_step)
+{
+    account(STEP, args->ns);
+    return 0;
+}
+
+TRACEPOINT_PROBE(fibdrv, fib_mul)
+{
+    account(MUL_LIMB + args->alg, args->ns);
+    return 0;
+}
+
+TRACEPOINT_PROBE(fibdrv, fib_ntt)
+{
+    u32 n = args->n;
+    struct total zero = {}, *t = ntt_len.lookup_or_try_init(&n, &zero);
+    if (t) {
+        __sync_fetch_and_add(&t->count, 1);
+        __sync_fetch_and_add(&t->ns, args->ns);
+    }
+    account(args->inverse ? INTT : NTT, args->ns);
+    return 0;
+}
+
+TRACEPOINT_PROBE(fibdrv, fib_copy)
+{
+    int zero = 0;
+    u64 *bytes = copied.lookup(&zero);
+    if (bytes)
+        __sync_fetch_and_add(bytes, args->bytes);
+    account(COPY, args->ns);
+    return 0;
+}
 """
 
+PHASES = ["request", "doubling step", "mul limb", "mul crt", "mul strassen",
+          "mul doubling", "ntt", "intt", "copy"]
+
 b = BPF(text=prog)
-b.attach_kprobe(event="fib_read", fn_name="probe_handler")
-b.attach_kretprobe(event="fib_read", fn_name="ret_handler")
-
-while 1:
-    try:
-        res = b.trace_fields()
-    except ValueError:
-        continue
-    print(res[5].decode("UTF-8"))
+
+
+def report():
+    totals = b["totals"]
+    request = totals[0].ns
+    print("%-14s %10s %14s %10s %7s" %
+          ("phase", "count", "total ns", "avg ns", "share"))
+    for i, name in enumerate(PHASES):
+        t = totals[i]
+        if not t.count:
+            continue
+        share = 100.0 * t.ns / request if request else 0
+        print("%-14s %10d %14d %10d %6.1f%%" %
+              (name, t.count, t.ns, t.ns // t.count, share))
+    print("copied %d bytes" % b["copied"][0].value)
+    lens = sorted(b["ntt_len"].items(), key=lambda kv: kv[0].value)
+    for n, t in lens:
+        print("  ntt length %-8d %10d %14d" % (n.value, t.count, t.ns))
+    print()
+
+
+# the phases nest, the products are part of the doubling steps which are
+# part of the requests, so the shares add up to more than 100%
+try:
+    while True:
+        time.sleep(args.interval if args.interval else 1 << 30)
+        report()
+        b["totals"].clear()
+        b["copied"].clear()
+        b["ntt_len"].clear()
+except KeyboardInterrupt:
+    report()
@@ -0,0 +1,196 @@
+#include <linux/debugfs.h>
+#include <linux/device.h>
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+#include "stats.h"
+
+// a result of at most 16^i limbs falls in size class i, the last is open
+#define FIB_STAT_SIZES 5
+// latencies in [2^i, 2^(i+1)) ns fall in bucket i, the last is open
+#define FIB_STAT_BUCKETS 40
+
+/**
+ * fib_stats - counters of a cpu, only ever added to by that cpu
+ * @lat: latency histograms by mode and size class
+ * @failed: calculations that returned no result
+ * @bytes: bytes of results copied to the user
+ */
+struct fib_stats {
+    u64 lat[FIB_STAT_MODES][FIB_STAT_SIZES][FIB_STAT_BUCKETS];
+    u64 failed;
+    u64 bytes;
+};
+
+static DEFINE_PER_CPU(struct fib_stats, fib_stats);
+
+static int fib_stat_size(size_t limbs)
+{
+    int size = limbs > 1 ? ilog2(limbs - 1) / 4 + 1 : 0;
+    return min_t(int, size, FIB_STAT_SIZES - 1);
+}
+
+// smallest number of limbs of a size class
+static size_t fib_stat_size_first(int size)
+{
+    return size ? (1UL << (4 * (size - 1))) + 1 : 1;
+}
+
+void fib_stat_result(enum fib_stat_mode mode, u64 ns, size_t limbs)
+{
+    int bucket = ns ? min_t(int, ilog2(ns), FIB_STAT_BUCKETS - 1) : 0;
+    this_cpu_inc(fib_stats.lat[mode][fib_stat_size(limbs)][bucket]);
+}
+
+void fib_stat_failed(void)
+{
+    this_cpu_inc(fib_stats.failed);
+}
+
+void fib_stat_bytes(size_t bytes)
+{
+    this_cpu_add(fib_stats.bytes, bytes);
+}
+
+/**
+ * fib_stat_pct: latency below which a share of the results fall
+ * @hist: histogram of the results
+ * @count: number of results in hist
+ * @pct: share in percent
+ * @return: upper bound of the bucket in nanoseconds, 0 if hist is empty
+ */
+static u64 fib_stat_pct(const u64 *hist, u64 count, int pct)
+{
+    u64 rank = div_u64(count * pct + 99, 100), seen = 0;
+    if (!count)
+        return 0;
+    for (int b = 0; b < FIB_STAT_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= rank)
+            return 2ULL << b;
+    }
+    return U64_MAX;
+}
+
+// sum the histograms of all cpus for a mode and size class
+static void fib_stat_hist(enum fib_stat_mode mode, int size, u64 *hist)
+{
+    int cpu;
+    memset(hist, 0, sizeof(u64) * FIB_STAT_BUCKETS);
+    for_each_possible_cpu (cpu) {
+        const struct fib_stats *st = per_cpu_ptr(&fib_stats, cpu);
+        for (int b = 0; b < FIB_STAT_BUCKETS; b++)
+            hist[b] += READ_ONCE(st->lat[mode][size][b]);
+    }
+}
+
+/*
+ * One line per size class: the smallest number of limbs of the class, the
+ * number of results, the p50 and p99 latencies in nanoseconds rounded up
+ * to a power of 2, then the count of every bucket of the histogram
+ */
+static int fib_stat_lat_show(struct seq_file *m, void *v)
+{
+    enum fib_stat_mode mode = (uintptr_t) m->private;
+    for (int s = 0; s < FIB_STAT_SIZES; s++) {
+        u64 hist[FIB_STAT_BUCKETS], count = 0;
+        fib_stat_hist(mode, s, hist);
+        for (int b = 0; b < FIB_STAT_BUCKETS; b++)
+            count += hist[b];
+        seq_printf(m, "%zu %llu %llu %llu", fib_stat_size_first(s), count,
+                   fib_stat_pct(hist, count, 50),
+                   fib_stat_pct(hist, count, 99));
+        for (int b = 0; b < FIB_STAT_BUCKETS; b++)
+            seq_printf(m, " %llu", hist[b]);
+        seq_putc(m, '\n');
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(fib_stat_lat);
+
+// number of results of a mode, the histograms are in debugfs
+static ssize_t fib_stat_show(enum fib_stat_mode mode, char *buf)
+{
+    u64 count = 0;
+    for (int s = 0; s < FIB_STAT_SIZES; s++) {
+        u64 hist[FIB_STAT_BUCKETS];
+        fib_stat_hist(mode, s, hist);
+        for (int b = 0; b < FIB_STAT_BUCKETS; b++)
+            count += hist[b];
+    }
+    return scnprintf(buf, PAGE_SIZE, "%llu\n", count);
+}
+
+#define FIB_STAT_MODE_ATTR(name, mode)                              \
+    static ssize_t name##_show(struct device *dev,                  \
+                               struct device_attribute *attr,       \
+                               char *buf)                           \
+    {                                                               \
+        return fib_stat_show(mode, buf);                            \
+    }                                                               \
+    static DEVICE_ATTR_RO(name)
+
+FIB_STAT_MODE_ATTR(cached, FIB_STAT_CACHED);
+FIB_STAT_MODE_ATTR(fast, FIB_STAT_FAST);
+FIB_STAT_MODE_ATTR(strassen, FIB_STAT_STRASSEN);
+
+#define FIB_STAT_SUM_ATTR(name)                                     \
+    static ssize_t name##_show(struct device *dev,                  \
+                               struct device_attribute *attr,       \
+                               char *buf)                           \
+    {                                                               \
+        u64 sum = 0;                                                \
+        int cpu;                                                    \
+        for_each_possible_cpu (cpu)                                 \
+            sum += READ_ONCE(per_cpu_ptr(&fib_stats, cpu)->name);   \
+        return scnprintf(buf, PAGE_SIZE, "%llu\n", sum);            \
+    }                                                               \
+    static DEVICE_ATTR_RO(name)
+
+FIB_STAT_SUM_ATTR(failed);
+FIB_STAT_SUM_ATTR(bytes);
+
+// counts added while the reset runs may survive it
+static ssize_t reset_store(struct device *dev,
+                           struct device_attribute *attr,
+                           const char *buf,
+                           size_t count)
+{
+    int cpu;
+    for_each_possible_cpu (cpu)
+        memset(per_cpu_ptr(&fib_stats, cpu), 0, sizeof(struct fib_stats));
+    return count;
+}
+static DEVICE_ATTR_WO(reset);
+
+static struct attribute *fib_stats_attrs[] = {
+    &dev_attr_cached.attr, &dev_attr_fast.attr,  &dev_attr_strassen.attr,
+    &dev_attr_failed.attr, &dev_attr_bytes.attr, &dev_attr_reset.attr,
+    NULL,
+};
+
+static const struct attribute_group fib_stats_group = {
+    .name = "stats",
+    .attrs = fib_stats_attrs,
+};
+
+const struct attribute_group *fib_stats_groups[] = {
+    &fib_stats_group,
+    NULL,
+};
+
+void fib_stats_init(struct dentry *dir)
+{
+    static const char *const names[FIB_STAT_MODES] = {
+        [FIB_STAT_CACHED] = "cached",
+        [FIB_STAT_FAST] = "fast",
+        [FIB_STAT_STRASSEN] = "strassen",
+    };
+    struct dentry *lat = debugfs_create_dir("latency", dir);
+    for (uintptr_t mode = 0; mode < FIB_STAT_MODES; mode++)
+        debugfs_create_file(names[mode], 0400, lat, (void *) mode,
+                            &fib_stat_lat_fops);
+}
@@ -0,0 +1,50 @@
+#ifndef __FIB_STATS_H_
+#define __FIB_STATS_H_
+
+#include <linux/debugfs.h>
+#include <linux/sysfs.h>
+#include <linux/types.h>
+
+/**
+ * fib_stat_mode - how a result was obtained
+ * @FIB_STAT_CACHED: served from the cache or the pair of the last read
+ * @FIB_STAT_FAST: calculated by fast doubling
+ * @FIB_STAT_STRASSEN: calculated by the transform based doubling
+ */
+enum fib_stat_mode {
+    FIB_STAT_CACHED,
+    FIB_STAT_FAST,
+    FIB_STAT_STRASSEN,
+    FIB_STAT_MODES,
+};
+
+/**
+ * fib_stat_result: account a result obtained in a mode
+ * @mode: how the result was obtained
+ * @ns: nanoseconds it took
+ * @limbs: number of limbs of the result
+ */
+void fib_stat_result(enum fib_stat_mode mode, u64 ns, size_t limbs);
+
+/**
+ * fib_stat_failed: account a calculation that returned no result
+ */
+void fib_stat_failed(void);
+
+/**
+ * fib_stat_bytes: account bytes copied to the user
+ * @bytes: number of bytes
+ */
+void fib_stat_bytes(size_t bytes);
+
+/**
+ * fib_stats_init: create the latency histograms in debugfs
+ * The module works without them, failures are not reported
+ * @dir: debugfs directory of the module
+ */
+void fib_stats_init(struct dentry *dir);
+
+// attributes of the stats directory of the device
+extern const struct attribute_group *fib_stats_groups[];
+
+#endif